@@ -35,7 +35,14 @@ LOCAL_CPPFLAGS := -fno-delete-null-pointer-checks \
                   -Wformat -Wformat-security \
                   -Werror=format-security
 LOCAL_SRC_FILES := \
-        bt_vendor.cc
+        bt_vendor.cc \
+        bt_vendor_coex.cc \
+        bt_vendor_dump.cc \
+        bt_vendor_latency.cc \
+        bt_vendor_monitor.cc \
+        bt_vendor_pool.cc \
+        bt_vendor_sco.cc \
+        bt_vendor_stats.cc
 
 LOCAL_C_INCLUDES := \
         $(TOP_DIR)packages/modules/Bluetooth/system/hci/include
@@ -19,13 +19,18 @@
 
 #define LOG_TAG "bt_vendor"
 
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <sys/ioctl.h>
@@ -35,48 +40,81 @@
 #include <utils/Log.h>
 #include <cutils/properties.h>
 
-#define BTPROTO_HCI 1
-#define HCI_CHANNEL_USER 1
-#define HCI_CHANNEL_CONTROL 3
-#define HCI_DEV_NONE 0xffff
+#include "bt_vendor.h"
+#include "bt_vendor_codec.h"
+#include "bt_vendor_coex.h"
+#include "bt_vendor_monitor.h"
+#include "bt_vendor_pool.h"
+#include "bt_vendor_sco.h"
+#include "bt_vendor_stats.h"
 
 #define RFKILL_TYPE_BLUETOOTH 2
-#define RFKILL_OP_CHANGE_ALL 3
 
 #define MGMT_OP_INDEX_LIST 0x0003
+#define MGMT_OP_SET_POWERED 0x0005
 #define MGMT_EV_INDEX_ADDED 0x0004
 #define MGMT_EV_COMMAND_COMP 0x0001
+#define MGMT_EV_COMMAND_STATUS 0x0002
+#define MGMT_STATUS_INVALID_INDEX 0x11
 #define MGMT_EV_SIZE_MAX 1024
 #define MGMT_EV_POLL_TIMEOUT 3000 /* 3000ms */
+#define MGMT_OP_TIMEOUT 1000 /* 1000ms */
+
+#define CMD_QUEUE_MAX 4
+#define CMD_TIMEOUT 2000 /* 2000ms */
+
+#define USB_DEVICES_DIR "/sys/bus/usb/devices"
+#define USB_IDS_MAX 8
+
+#define WAIT_MIN_SAMPLES 8
+#define WAIT_MARGIN 200 /* 200ms */
+#define WAIT_BUDGET_MIN 300 /* 300ms */
+#define WAIT_BUDGET_MAX 10000 /* 10s */
+
+/* bt_vendor_op_audio_state_t.state values, sco_state_t of the stack's
+ * hci_audio.h which the vendor interface does not include */
+#define AUDIO_STATE_ON 2
+#define AUDIO_STATE_SETUP 3
 
 #define IOCTL_HCIDEVDOWN _IOW('H', 202, int)
 
-struct sockaddr_hci {
-  sa_family_t hci_family;
-  unsigned short hci_dev;
-  unsigned short hci_channel;
-};
+#define HCI_RESET 0x0c03
+#define BT_VENDOR_PROBE_TIMEOUT 500 /* 500ms */
 
-struct rfkill_event {
-  uint32_t idx;
-  uint8_t type;
-  uint8_t op;
-  uint8_t soft, hard;
-} __attribute__((packed));
+enum { BT_VENDOR_DOWN_IOCTL, BT_VENDOR_DOWN_MGMT };
 
-struct mgmt_pkt {
+/* Bring-up strategy variants that can be compared on real devices, see
+ * bt_vendor_select_strategy() */
+struct bt_vendor_strategy {
+  const char* name;
+  int speculative; /* power down first, only wait for the index on failure */
+  int powerdown;
+  int wait_ms; /* 0 to derive the budget from past bring-ups */
+};
+
+struct bt_vendor_cmd {
   uint16_t opcode;
-  uint16_t index;
-  uint16_t len;
-  uint8_t data[MGMT_EV_SIZE_MAX];
-} __attribute__((packed));
+  HC_BT_HDR* p_buf;
+  tINT_CMD_CBACK cback;
+};
 
-struct mgmt_event_read_index {
-  uint16_t cc_opcode;
-  uint8_t status;
-  uint16_t num_intf;
-  uint16_t index[0];
-} __attribute__((packed));
+struct bt_vendor_timing {
+  uint64_t wait_ms;
+  uint64_t down_ms;
+  uint64_t bind_ms;
+  uint64_t total_ms;
+};
+
+static const struct bt_vendor_strategy bt_vendor_strategies[] = {
+    {"default", 0, BT_VENDOR_DOWN_IOCTL, 0},
+    {"speculative", 1, BT_VENDOR_DOWN_IOCTL, 0},
+    {"mgmt", 0, BT_VENDOR_DOWN_MGMT, 0},
+    {"short-wait", 0, BT_VENDOR_DOWN_IOCTL, 1500},
+    {"fixed-wait", 0, BT_VENDOR_DOWN_IOCTL, MGMT_EV_POLL_TIMEOUT},
+};
+
+#define BT_VENDOR_NUM_STRATEGIES \
+  (sizeof(bt_vendor_strategies) / sizeof(bt_vendor_strategies[0]))
 
 static const bt_vendor_callbacks_t* bt_vendor_callbacks;
 static unsigned char bt_vendor_local_bdaddr[6];
@@ -84,10 +122,231 @@ static int bt_vendor_fd = -1;
 static int hci_interface;
 static int rfkill_en;
 static int bt_hwcfg_en;
+static const struct bt_vendor_strategy* bt_vendor_strategy =
+    &bt_vendor_strategies[0];
+static uint16_t probe_opcode;
+static int probe_timeout;
+static int probe_pending;
+static uint64_t probe_start;
+static struct bt_vendor_timing probe_timing;
+static timer_t probe_timer;
+static int probe_timer_created;
+static pthread_mutex_t probe_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t cmd_lock = PTHREAD_MUTEX_INITIALIZER;
+static int cmd_busy;
+static uint16_t cmd_opcode;
+static tINT_CMD_CBACK cmd_cback;
+static struct bt_vendor_cmd cmd_queue[CMD_QUEUE_MAX];
+static int cmd_head;
+static int cmd_count;
+/* The command in flight still waits for its response or deadline */
+static int cmd_inflight;
+static uint64_t cmd_sent;
+static timer_t cmd_timer;
+static int cmd_timer_created;
+static uint32_t boot_hash;
+static int cold_boot;
+static int mgmt_op_timeout = MGMT_OP_TIMEOUT;
+static int usb_ids_count;
+static uint16_t usb_ids[USB_IDS_MAX][2];
+
+static uint32_t bt_vendor_hash(const char* str) {
+  uint32_t hash = 2166136261u;
+
+  while (*str) hash = (hash ^ (uint8_t)*str++) * 16777619u;
+
+  return hash;
+}
+
+static int bt_vendor_read_boot_id(char* buf, size_t len) {
+  ssize_t n;
+  int fd;
+
+  fd = open("/proc/sys/kernel/random/boot_id", O_RDONLY);
+  if (fd < 0) return -1;
+
+  n = read(fd, buf, len - 1);
+  close(fd);
+  if (n <= 0) return -1;
+
+  buf[n] = '\0';
+  buf[strcspn(buf, "\n")] = '\0';
+
+  return 0;
+}
+
+static uint64_t bt_vendor_strategy_stat(const struct bt_vendor_strategy* s,
+                                        const char* name) {
+  char key[BT_STATS_KEY_MAX];
+
+  snprintf(key, sizeof(key), "bringup.%s.%s", s->name, name);
+  return bt_stats_get(key);
+}
+
+static void bt_vendor_strategy_add(const char* name, uint64_t val) {
+  char key[BT_STATS_KEY_MAX];
+
+  snprintf(key, sizeof(key), "bringup.%s.%s", bt_vendor_strategy->name, name);
+  bt_stats_add(key, val);
+}
+
+static void bt_vendor_strategy_max(const char* name, uint64_t val) {
+  char key[BT_STATS_KEY_MAX];
+
+  snprintf(key, sizeof(key), "bringup.%s.%s", bt_vendor_strategy->name, name);
+  bt_stats_max(key, val);
+}
+
+/*
+ * persist.vendor.bluetooth.bringup selects the bring-up strategy:
+ * a variant name forces that variant, "ab" picks one per boot from a
+ * hash of the kernel boot id. Anything else uses the default variant.
+ */
+static void bt_vendor_select_strategy(void) {
+  char prop_value[PROPERTY_VALUE_MAX];
+  unsigned int i;
+
+  property_get("persist.vendor.bluetooth.bringup", prop_value, "default");
+
+  if (!strcmp(prop_value, "ab")) {
+    if (!boot_hash)
+      ALOGE("Unable to read boot id, using default bring-up");
+    else
+      bt_vendor_strategy =
+          &bt_vendor_strategies[boot_hash % BT_VENDOR_NUM_STRATEGIES];
+  } else {
+    for (i = 0; i < BT_VENDOR_NUM_STRATEGIES; i++)
+      if (!strcmp(prop_value, bt_vendor_strategies[i].name))
+        bt_vendor_strategy = &bt_vendor_strategies[i];
+
+    if (strcmp(prop_value, bt_vendor_strategy->name))
+      ALOGE("Unknown bring-up strategy %s", prop_value);
+  }
+
+  ALOGI("Using bring-up strategy %s", bt_vendor_strategy->name);
+}
+
+static void bt_vendor_log_strategies(void) {
+  const struct bt_vendor_strategy* s;
+  uint64_t runs;
+  unsigned int i;
+
+  for (i = 0; i < BT_VENDOR_NUM_STRATEGIES; i++) {
+    s = &bt_vendor_strategies[i];
+
+    runs = bt_vendor_strategy_stat(s, "runs");
+    if (!runs) continue;
+
+    ALOGI("bring-up %s: %llu runs, %llu failed, avg wait %llu ms, "
+          "down %llu ms, bind %llu ms, total %llu ms, max %llu ms",
+          s->name, (unsigned long long)runs,
+          (unsigned long long)bt_vendor_strategy_stat(s, "fail"),
+          (unsigned long long)(bt_vendor_strategy_stat(s, "wait_ms") / runs),
+          (unsigned long long)(bt_vendor_strategy_stat(s, "down_ms") / runs),
+          (unsigned long long)(bt_vendor_strategy_stat(s, "bind_ms") / runs),
+          (unsigned long long)(bt_vendor_strategy_stat(s, "total_ms") / runs),
+          (unsigned long long)bt_vendor_strategy_stat(s, "total_max_ms"));
+  }
+}
+
+/*
+ * Wait budgets come from the last BT_STATS_SAMPLES observed durations
+ * of the same phase, kept apart for the first bring-up after boot and
+ * for later toggles. With that few samples p99.9 is the slowest one.
+ * Samples are dropped when the board changes.
+ */
+static void bt_vendor_init_history(void) {
+  char prop_value[PROPERTY_VALUE_MAX];
+  char boot_id[64];
+  uint32_t board;
+
+  if (!bt_vendor_read_boot_id(boot_id, sizeof(boot_id)))
+    boot_hash = bt_vendor_hash(boot_id);
+
+  cold_boot = !boot_hash || bt_stats_get("boot.id") != boot_hash;
+
+  property_get("ro.product.board", prop_value, "");
+  board = bt_vendor_hash(prop_value);
+
+  if (bt_stats_get("wait.board") != board) {
+    ALOGI("No wait history for board %s", prop_value);
+    bt_stats_clear_samples();
+    bt_stats_set("wait.board", board);
+  }
+}
+
+static void bt_vendor_wait_key(char* key, const char* phase) {
+  snprintf(key, BT_STATS_KEY_MAX, "wait.%s.%s", cold_boot ? "cold" : "warm",
+           phase);
+}
+
+static int bt_vendor_wait_budget(const char* phase, int fallback) {
+  uint32_t val[BT_STATS_SAMPLES];
+  char key[BT_STATS_KEY_MAX];
+  uint32_t slowest = 0;
+  int i, n, budget;
+
+  bt_vendor_wait_key(key, phase);
+
+  n = bt_stats_get_samples(key, val);
+  if (n < WAIT_MIN_SAMPLES) return fallback;
+
+  for (i = 0; i < n; i++)
+    if (val[i] > slowest) slowest = val[i];
+
+  budget = slowest + slowest / 2 + WAIT_MARGIN;
+  if (budget < WAIT_BUDGET_MIN) budget = WAIT_BUDGET_MIN;
+  if (budget > WAIT_BUDGET_MAX) budget = WAIT_BUDGET_MAX;
+
+  return budget;
+}
+
+static void bt_vendor_wait_sample(const char* phase, uint64_t ms) {
+  char key[BT_STATS_KEY_MAX];
+
+  bt_vendor_wait_key(key, phase);
+  bt_stats_sample(key, ms < WAIT_BUDGET_MAX ? ms : WAIT_BUDGET_MAX);
+}
+
+/*
+ * A timed out wait only tells that the device took longer than the
+ * budget, or never came (no controller). It is not recorded as is, or
+ * an absent controller would push the budget to WAIT_BUDGET_MAX. An
+ * adaptive budget that proved shorter than the fallback is brought back
+ * to the fallback instead.
+ */
+static void bt_vendor_wait_timeout(const char* phase, int budget,
+                                   int fallback) {
+  if (budget >= fallback) return;
+
+  bt_vendor_wait_sample(phase, (fallback - WAIT_MARGIN) * 2 / 3);
+}
+
+static void bt_vendor_record_bringup(const struct bt_vendor_timing* t, int ok) {
+  bt_vendor_strategy_add("runs", 1);
+  if (!ok) bt_vendor_strategy_add("fail", 1);
+  bt_vendor_strategy_add("wait_ms", t->wait_ms);
+  bt_vendor_strategy_add("down_ms", t->down_ms);
+  bt_vendor_strategy_add("bind_ms", t->bind_ms);
+  bt_vendor_strategy_add("total_ms", t->total_ms);
+  bt_vendor_strategy_max("total_max_ms", t->total_ms);
+
+  ALOGI("bring-up %s %s: wait %llu ms, down %llu ms, bind %llu ms, "
+        "total %llu ms", bt_vendor_strategy->name, ok ? "done" : "failed",
+        (unsigned long long)t->wait_ms, (unsigned long long)t->down_ms,
+        (unsigned long long)t->bind_ms, (unsigned long long)t->total_ms);
+
+  /* Later bring-ups in this boot are warm toggles */
+  cold_boot = 0;
+  bt_stats_set("boot.id", boot_hash);
+}
 
 static int bt_vendor_init(const bt_vendor_callbacks_t* p_cb,
                           unsigned char* local_bdaddr) {
   char prop_value[PROPERTY_VALUE_MAX];
+  unsigned int vid, pid;
+  char* saveptr = NULL;
+  char* tok;
 
   ALOGI("%s", __func__);
 
@@ -119,6 +378,50 @@ static int bt_vendor_init(const bt_vendor_callbacks_t* p_cb,
   bt_hwcfg_en = property_get("vendor.bluetooth.hwcfg", prop_value, NULL) > 0 ? 1 : 0;
   if (bt_hwcfg_en) ALOGI("HWCFG enabled");
 
+  property_get("vendor.bluetooth.probe", prop_value, "off");
+
+  if (!strcmp(prop_value, "reset"))
+    probe_opcode = HCI_RESET;
+  else if (!strcmp(prop_value, "version"))
+    probe_opcode = HCI_READ_LOCAL_VERSION_INFO;
+  else if (!strcmp(prop_value, "intel"))
+    probe_opcode = bt_codec::kIntelReadVersion;
+  else
+    probe_opcode = 0;
+
+  property_get("vendor.bluetooth.probe_timeout", prop_value, "500");
+
+  probe_timeout = atoi(prop_value);
+  if (probe_timeout <= 0) probe_timeout = BT_VENDOR_PROBE_TIMEOUT;
+  if (probe_opcode)
+    ALOGI("Controller probe 0x%04x enabled, %d ms", probe_opcode,
+          probe_timeout);
+
+  /* Comma separated vvvv:pppp USB ids the controller enumerates as */
+  property_get("vendor.bluetooth.usb_ids", prop_value, "");
+
+  usb_ids_count = 0;
+  for (tok = strtok_r(prop_value, ",", &saveptr);
+       tok && usb_ids_count < USB_IDS_MAX;
+       tok = strtok_r(NULL, ",", &saveptr)) {
+    if (sscanf(tok, "%x:%x", &vid, &pid) != 2) {
+      ALOGE("Invalid USB id %s", tok);
+      continue;
+    }
+    usb_ids[usb_ids_count][0] = vid;
+    usb_ids[usb_ids_count][1] = pid;
+    usb_ids_count++;
+  }
+
+  bt_pkt_pool_init();
+  bt_monitor_init();
+  bt_coex_init();
+
+  bt_stats_load();
+  bt_vendor_init_history();
+  bt_vendor_log_strategies();
+  bt_vendor_select_strategy();
+
   return 0;
 }
 
@@ -139,14 +442,9 @@ static int bt_vendor_hw_cfg(int stop) {
   return 0;
 }
 
-static int bt_vendor_wait_hcidev(void) {
+static int bt_vendor_mgmt_open(void) {
   struct sockaddr_hci addr;
-  struct pollfd fds[1];
-  struct mgmt_pkt ev;
   int fd;
-  int ret = 0;
-
-  ALOGI("%s", __func__);
 
   fd = socket(PF_BLUETOOTH, SOCK_RAW, BTPROTO_HCI);
   if (fd < 0) {
@@ -165,17 +463,187 @@ static int bt_vendor_wait_hcidev(void) {
     return -1;
   }
 
+  return fd;
+}
+
+static int bt_vendor_mgmt_power_off(void) {
+  /* Set Powered Command */
+  const auto cmd = bt_codec::mgmt_cmd(MGMT_OP_SET_POWERED, hci_interface, 0);
+  uint8_t buf[bt_codec::kMgmtHdrSize + MGMT_EV_SIZE_MAX];
+  struct pollfd fds[1];
+  int fd, n;
+  int ret = -1;
+
+  fd = bt_vendor_mgmt_open();
+  if (fd < 0) return -1;
+
   fds[0].fd = fd;
   fds[0].events = POLLIN;
 
+  if (write(fd, cmd.data(), cmd.size()) != (ssize_t)cmd.size()) {
+    ALOGE("Unable to write mgmt command: %s", strerror(errno));
+    goto end;
+  }
+
+  while (1) {
+    n = poll(fds, 1, mgmt_op_timeout);
+    if (n <= 0) {
+      if (n == 0) errno = ETIMEDOUT;
+      break;
+    }
+
+    n = read(fd, buf, sizeof(buf));
+    if (n < 0) break;
+
+    bt_codec::mgmt_view ev(buf, n);
+    if (!ev.valid() || (ev.opcode() != MGMT_EV_COMMAND_COMP &&
+                        ev.opcode() != MGMT_EV_COMMAND_STATUS))
+      continue;
+
+    bt_codec::mgmt_cmd_status_view cs(ev.params());
+    if (ev.index() != hci_interface || !cs.valid() ||
+        cs.opcode() != MGMT_OP_SET_POWERED)
+      continue;
+
+    if (cs.status() == 0)
+      ret = 0;
+    else
+      errno = cs.status() == MGMT_STATUS_INVALID_INDEX ? ENODEV : EIO;
+    break;
+  }
+
+end:
+  close(fd);
+  return ret;
+}
+
+static int bt_vendor_powerdown(int fd) {
+  if (bt_vendor_strategy->powerdown == BT_VENDOR_DOWN_MGMT) {
+    if (bt_vendor_mgmt_power_off()) {
+      ALOGE("mgmt power off error: %s", strerror(errno));
+      return -1;
+    }
+    return 0;
+  }
+
+  /* Force interface down to use HCI user channel */
+  if (ioctl(fd, IOCTL_HCIDEVDOWN, hci_interface)) {
+    ALOGE("HCIDEVDOWN ioctl error: %s", strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+static int bt_vendor_read_sysfs(const char* path, char* buf, size_t len) {
+  ssize_t n;
+  int fd;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0) return -1;
+
+  n = read(fd, buf, len - 1);
+  close(fd);
+  if (n <= 0) return -1;
+
+  buf[n] = '\0';
+
+  return 0;
+}
+
+static int bt_vendor_usb_match(const char* dev) {
+  char path[PATH_MAX];
+  char buf[8];
+  unsigned int vid, pid;
+  int i;
+
+  snprintf(path, sizeof(path), USB_DEVICES_DIR "/%s/idVendor", dev);
+  if (bt_vendor_read_sysfs(path, buf, sizeof(buf))) return 0;
+  vid = strtoul(buf, NULL, 16);
+
+  snprintf(path, sizeof(path), USB_DEVICES_DIR "/%s/idProduct", dev);
+  if (bt_vendor_read_sysfs(path, buf, sizeof(buf))) return 0;
+  pid = strtoul(buf, NULL, 16);
+
+  for (i = 0; i < usb_ids_count; i++)
+    if (usb_ids[i][0] == vid && usb_ids[i][1] == pid) return 1;
+
+  return 0;
+}
+
+/*
+ * Tells within milliseconds whether waiting for the index is worth it.
+ * A registered hciN or an enumerated controller means wait; when USB
+ * ids are configured and none of them is enumerated, the controller
+ * cannot appear and -1 is returned with errno set to ENODEV.
+ */
+static int bt_vendor_check_presence(void) {
+  char path[PATH_MAX];
+  char driver[PATH_MAX];
+  struct dirent* de;
+  DIR* dir;
+  ssize_t n;
+  int found = 0;
+
+  snprintf(path, sizeof(path), "/sys/class/bluetooth/hci%d", hci_interface);
+  if (!access(path, F_OK) || !usb_ids_count) return 0;
+
+  dir = opendir(USB_DEVICES_DIR);
+  if (!dir) {
+    ALOGE("Unable to list %s: %s", USB_DEVICES_DIR, strerror(errno));
+    return 0;
+  }
+
+  /* Interfaces ("1-4:1.0") carry no ids, only devices ("1-4") do */
+  while (!found && (de = readdir(dir))) {
+    if (de->d_name[0] == '.' || strchr(de->d_name, ':')) continue;
+    if (!bt_vendor_usb_match(de->d_name)) continue;
+
+    found = 1;
+
+    snprintf(path, sizeof(path), USB_DEVICES_DIR "/%s/%s:1.0/driver",
+             de->d_name, de->d_name);
+    n = readlink(path, driver, sizeof(driver) - 1);
+    if (n > 0) {
+      driver[n] = '\0';
+      ALOGI("Controller %s enumerated, bound to %s", de->d_name,
+            strrchr(driver, '/') ? strrchr(driver, '/') + 1 : driver);
+    } else {
+      ALOGI("Controller %s enumerated, no driver bound yet", de->d_name);
+    }
+  }
+
+  closedir(dir);
+
+  if (!found) {
+    ALOGE("Controller absent, none of %d configured USB ids enumerated",
+          usb_ids_count);
+    errno = ENODEV;
+    return -1;
+  }
+
+  return 0;
+}
+
+static int bt_vendor_wait_hcidev(int timeout) {
   /* Read Controller Index List Command */
-  ev.opcode = MGMT_OP_INDEX_LIST;
-  ev.index = HCI_DEV_NONE;
-  ev.len = 0;
+  const auto cmd = bt_codec::mgmt_cmd(MGMT_OP_INDEX_LIST, HCI_DEV_NONE);
+  uint8_t buf[bt_codec::kMgmtHdrSize + MGMT_EV_SIZE_MAX];
+  struct pollfd fds[1];
+  int fd;
+  int ret = 0;
+
+  ALOGI("%s", __func__);
+
+  fd = bt_vendor_mgmt_open();
+  if (fd < 0) return -1;
+
+  fds[0].fd = fd;
+  fds[0].events = POLLIN;
 
   ssize_t wrote;
-  wrote = write(fd, &ev, sizeof(mgmt_pkt) - MGMT_EV_SIZE_MAX);
-  if (wrote != 6) {
+  wrote = write(fd, cmd.data(), cmd.size());
+  if (wrote != (ssize_t)cmd.size()) {
     ALOGE("Unable to write mgmt command: %s", strerror(errno));
     ret = -1;
     goto end;
@@ -183,19 +651,20 @@ static int bt_vendor_wait_hcidev(void) {
 
   while (1) {
     int n;
-    n = poll(fds, 1, MGMT_EV_POLL_TIMEOUT);
+    n = poll(fds, 1, timeout);
     if (n == -1) {
       ALOGE("Poll error: %s", strerror(errno));
       ret = -1;
       break;
     } else if (n == 0) {
       ALOGE("Timeout, no HCI device detected");
+      errno = ETIMEDOUT;
       ret = -1;
       break;
     }
 
     if (fds[0].revents & POLLIN) {
-      n = read(fd, &ev, sizeof(struct mgmt_pkt));
+      n = read(fd, buf, sizeof(buf));
       if (n < 0) {
         ALOGE("Error reading control channel: %s",
                   strerror(errno));
@@ -203,19 +672,20 @@ static int bt_vendor_wait_hcidev(void) {
         break;
       }
 
-      if (ev.opcode == MGMT_EV_INDEX_ADDED && ev.index == hci_interface) {
-        goto end;
-      } else if (ev.opcode == MGMT_EV_COMMAND_COMP) {
-        struct mgmt_event_read_index* cc;
-        int i;
+      bt_codec::mgmt_view ev(buf, n);
+      if (!ev.valid()) continue;
 
-        cc = (struct mgmt_event_read_index*)ev.data;
+      if (ev.opcode() == MGMT_EV_INDEX_ADDED && ev.index() == hci_interface) {
+        goto end;
+      } else if (ev.opcode() == MGMT_EV_COMMAND_COMP) {
+        bt_codec::mgmt_cmd_status_view cc(ev.params());
+        bt_codec::mgmt_index_list_view list(cc.rparams());
+        size_t i;
 
-        if (cc->cc_opcode != MGMT_OP_INDEX_LIST || cc->status != 0) continue;
+        if (cc.opcode() != MGMT_OP_INDEX_LIST || cc.status() != 0) continue;
 
-        if (cc->num_intf > 0)
-          for (i = 0; i < cc->num_intf; i++)
-            if (cc->index[i] == hci_interface) goto end;
+        for (i = 0; i < list.num() && list.has_index(i); i++)
+          if (list.index(i) == hci_interface) goto end;
       }
     }
   }
@@ -249,21 +719,35 @@ static int bt_vendor_open(void* param) {
   return 1;
 }
 
+static void bt_vendor_cmd_reset(void);
+static int64_t bt_vendor_probe_finish(void);
+
 static int bt_vendor_close(void* param) {
   (void)(param);
 
   ALOGI("%s", __func__);
 
+  /* The session is gone, a late deadline must not power cycle the
+   * controller or report to it */
+  if (bt_vendor_probe_finish() >= 0)
+    ALOGI("Controller probe abandoned on close");
+
+  bt_coex_reset();
+  bt_monitor_stop();
+  bt_vendor_cmd_reset();
+
   if (bt_vendor_fd != -1) {
     close(bt_vendor_fd);
     bt_vendor_fd = -1;
   }
 
+  bt_pkt_pool_dump();
+
   return 0;
 }
 
 static int bt_vendor_rfkill(int block) {
-  struct rfkill_event event;
+  const auto event = bt_codec::rfkill_change_all(RFKILL_TYPE_BLUETOOTH, block);
   int fd;
 
   ALOGI("%s", __func__);
@@ -274,14 +758,8 @@ static int bt_vendor_rfkill(int block) {
     return -1;
   }
 
-  memset(&event, 0, sizeof(struct rfkill_event));
-  event.op = RFKILL_OP_CHANGE_ALL;
-  event.type = RFKILL_TYPE_BLUETOOTH;
-  event.hard = block;
-  event.soft = block;
-
   ssize_t len;
-  len = write(fd, &event, sizeof(event));
+  len = write(fd, event.data(), event.size());
   if (len < 0) {
     ALOGE("Failed to change rfkill state");
     close(fd);
@@ -292,13 +770,426 @@ static int bt_vendor_rfkill(int block) {
   return 0;
 }
 
+/* Power cycle the controller so that a restarted stack finds it in a
+ * sane state. Without rfkill control there is nothing to escalate to and
+ * the stack restart is the only recovery. */
+void bt_vendor_recover(const char* reason) {
+  ALOGE("Controller recovery: %s", reason);
+  bt_stats_add("recovery.runs", 1);
+
+  if (!rfkill_en) return;
+
+  bt_vendor_hw_cfg(1);
+  bt_vendor_rfkill(1);
+
+  if (bt_vendor_rfkill(0) || bt_vendor_hw_cfg(0)) {
+    ALOGE("Controller power cycle failed");
+    bt_stats_add("recovery.fail", 1);
+  }
+}
+
+static HC_BT_HDR* bt_vendor_alloc_cmd(uint16_t opcode, uint8_t plen) {
+  HC_BT_HDR* p_buf;
+  uint8_t* p;
+
+  p_buf = (HC_BT_HDR*)bt_vendor_callbacks->alloc(
+      BT_HC_HDR_SIZE + bt_codec::kHciCmdHdrSize + plen);
+  if (!p_buf) return NULL;
+
+  p_buf->event = MSG_STACK_TO_HC_HCI_CMD;
+  p_buf->offset = 0;
+  p_buf->layer_specific = 0;
+  p_buf->len = bt_codec::kHciCmdHdrSize + plen;
+
+  p = (uint8_t*)(p_buf + 1);
+  bt_codec::put_hci_cmd_hdr(p, opcode, plen);
+
+  return p_buf;
+}
+
+void bt_vendor_free_evt(void* p_mem) {
+  if (bt_vendor_callbacks) bt_vendor_callbacks->dealloc(p_mem);
+}
+
+static void bt_vendor_cmd_next(void);
+
+/* Response to the command in flight, the next queued one follows */
+static void bt_vendor_cmd_cback(void* p_mem) {
+  HC_BT_HDR* p_evt_buf = (HC_BT_HDR*)p_mem;
+  bt_codec::hci_event_view evt(bt_codec::view(
+      (uint8_t*)(p_evt_buf + 1) + p_evt_buf->offset, p_evt_buf->len));
+  tINT_CMD_CBACK cback = NULL;
+  int claimed;
+
+  pthread_mutex_lock(&cmd_lock);
+  claimed = cmd_inflight && evt.cmd_status(cmd_opcode) != 0xff;
+  if (claimed) {
+    cmd_inflight = 0;
+    cback = cmd_cback;
+  }
+  pthread_mutex_unlock(&cmd_lock);
+
+  /* Late answer to a command that already passed its deadline */
+  if (!claimed) {
+    ALOGE("Dropping stale response to a library command");
+    bt_vendor_free_evt(p_mem);
+    return;
+  }
+
+  if (cback)
+    cback(p_mem);
+  else
+    bt_vendor_free_evt(p_mem);
+
+  bt_vendor_cmd_next();
+}
+
+/*
+ * A response that never comes (a hung controller, or a vendor command
+ * the stack does not route back) must not hold back the library's
+ * commands for the rest of the session.
+ */
+static void bt_vendor_cmd_timeout(union sigval sv) {
+  tINT_CMD_CBACK cback;
+  uint16_t opcode;
+
+  (void)(sv);
+
+  pthread_mutex_lock(&cmd_lock);
+
+  if (!cmd_inflight || bt_vendor_now_ms() - cmd_sent < CMD_TIMEOUT) {
+    pthread_mutex_unlock(&cmd_lock);
+    return;
+  }
+
+  cmd_inflight = 0;
+  cback = cmd_cback;
+  opcode = cmd_opcode;
+
+  pthread_mutex_unlock(&cmd_lock);
+
+  ALOGE("Command 0x%04x not answered within %d ms", opcode, CMD_TIMEOUT);
+  bt_stats_add("cmd.timeout", 1);
+
+  if (cback) cback(NULL);
+
+  bt_vendor_cmd_next();
+}
+
+/* Hands the command to the stack, cmd_busy is already set for it */
+static int bt_vendor_cmd_xmit(const struct bt_vendor_cmd* cmd) {
+  const bt_vendor_callbacks_t* cb = bt_vendor_callbacks;
+  struct itimerspec its;
+  struct sigevent se;
+
+  /* Cleaned up, the buffer went away with the stack */
+  if (!cb) return -1;
+
+  if (!cmd_timer_created) {
+    memset(&se, 0, sizeof(se));
+    se.sigev_notify = SIGEV_THREAD;
+    se.sigev_notify_function = bt_vendor_cmd_timeout;
+
+    if (timer_create(CLOCK_MONOTONIC, &se, &cmd_timer))
+      ALOGE("Unable to create command timer: %s", strerror(errno));
+    else
+      cmd_timer_created = 1;
+  }
+
+  pthread_mutex_lock(&cmd_lock);
+  cmd_opcode = cmd->opcode;
+  cmd_cback = cmd->cback;
+  cmd_inflight = 1;
+  cmd_sent = bt_vendor_now_ms();
+  pthread_mutex_unlock(&cmd_lock);
+
+  if (cmd_timer_created) {
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = CMD_TIMEOUT / 1000;
+    its.it_value.tv_nsec = (CMD_TIMEOUT % 1000) * 1000000;
+    timer_settime(cmd_timer, 0, &its, NULL);
+  }
+
+  if (!cb->xmit_cb(cmd->opcode, cmd->p_buf, bt_vendor_cmd_cback)) {
+    ALOGE("Unable to send command 0x%04x", cmd->opcode);
+    cb->dealloc(cmd->p_buf);
+
+    pthread_mutex_lock(&cmd_lock);
+    cmd_inflight = 0;
+    pthread_mutex_unlock(&cmd_lock);
+
+    return -1;
+  }
+
+  return 0;
+}
+
+static void bt_vendor_cmd_next(void) {
+  struct bt_vendor_cmd cmd;
+
+  while (1) {
+    pthread_mutex_lock(&cmd_lock);
+
+    /* Nothing is sent once the stack has cleaned up */
+    if (!bt_vendor_callbacks) cmd_count = 0;
+
+    if (!cmd_count) {
+      cmd_busy = 0;
+      cmd_cback = NULL;
+      pthread_mutex_unlock(&cmd_lock);
+      return;
+    }
+
+    cmd = cmd_queue[cmd_head];
+    cmd_head = (cmd_head + 1) % CMD_QUEUE_MAX;
+    cmd_count--;
+
+    pthread_mutex_unlock(&cmd_lock);
+
+    if (!bt_vendor_cmd_xmit(&cmd)) return;
+
+    /* The sender was told the command is on its way */
+    if (cmd.cback) cmd.cback(NULL);
+  }
+}
+
+/*
+ * The stack tracks a single outstanding internal command, so the
+ * library keeps one of its own in flight at a time and queues the
+ * others until the response comes back.
+ */
+int bt_vendor_send_cmd(uint16_t opcode, const uint8_t* params, uint8_t plen,
+                       tINT_CMD_CBACK cback) {
+  struct bt_vendor_cmd cmd;
+
+  if (!bt_vendor_callbacks) return -1;
+
+  cmd.opcode = opcode;
+  cmd.cback = cback;
+  cmd.p_buf = bt_vendor_alloc_cmd(opcode, plen);
+  if (!cmd.p_buf) {
+    ALOGE("Unable to allocate command 0x%04x", opcode);
+    return -1;
+  }
+
+  if (plen)
+    memcpy((uint8_t*)(cmd.p_buf + 1) + bt_codec::kHciCmdHdrSize, params,
+           plen);
+
+  pthread_mutex_lock(&cmd_lock);
+
+  if (cmd_busy) {
+    if (cmd_count == CMD_QUEUE_MAX) {
+      pthread_mutex_unlock(&cmd_lock);
+      ALOGE("Command 0x%04x dropped, 0x%04x outstanding", opcode,
+            cmd_opcode);
+      bt_vendor_callbacks->dealloc(cmd.p_buf);
+      return -1;
+    }
+
+    cmd_queue[(cmd_head + cmd_count) % CMD_QUEUE_MAX] = cmd;
+    cmd_count++;
+    pthread_mutex_unlock(&cmd_lock);
+    return 0;
+  }
+
+  cmd_busy = 1;
+  pthread_mutex_unlock(&cmd_lock);
+
+  if (bt_vendor_cmd_xmit(&cmd)) {
+    bt_vendor_cmd_next();
+    return -1;
+  }
+
+  return 0;
+}
+
+uint64_t bt_vendor_cmd_sent(void) {
+  uint64_t sent;
+
+  pthread_mutex_lock(&cmd_lock);
+  sent = cmd_inflight ? cmd_sent : 0;
+  pthread_mutex_unlock(&cmd_lock);
+
+  return sent;
+}
+
+/* The stack is gone, a late response is only released */
+static void bt_vendor_cmd_reset(void) {
+  pthread_mutex_lock(&cmd_lock);
+
+  while (cmd_count) {
+    if (bt_vendor_callbacks)
+      bt_vendor_callbacks->dealloc(cmd_queue[cmd_head].p_buf);
+    cmd_head = (cmd_head + 1) % CMD_QUEUE_MAX;
+    cmd_count--;
+  }
+
+  cmd_busy = 0;
+  cmd_inflight = 0;
+  cmd_cback = NULL;
+
+  pthread_mutex_unlock(&cmd_lock);
+}
+
+/* Completes a pending probe, returns the elapsed time or -1 if the probe
+ * was already completed by the response or the deadline */
+static int64_t bt_vendor_probe_finish(void) {
+  struct itimerspec its;
+  int64_t elapsed = -1;
+
+  pthread_mutex_lock(&probe_lock);
+
+  if (probe_pending) {
+    probe_pending = 0;
+    elapsed = bt_vendor_now_ms() - probe_start;
+
+    memset(&its, 0, sizeof(its));
+    timer_settime(probe_timer, 0, &its, NULL);
+  }
+
+  pthread_mutex_unlock(&probe_lock);
+
+  return elapsed;
+}
+
+/* Reports the result first, the stats file is written after the stack
+ * got going */
+static void bt_vendor_fw_cfg_done(bt_vendor_op_result_t result) {
+  if (result == BT_VND_OP_RESULT_SUCCESS) bt_monitor_start(hci_interface);
+
+  if (bt_vendor_callbacks) bt_vendor_callbacks->fwcfg_cb(result);
+
+  bt_stats_save();
+}
+
+static void bt_vendor_probe_cback(void* p_mem) {
+  HC_BT_HDR* p_evt_buf = (HC_BT_HDR*)p_mem;
+  uint8_t status;
+  int64_t elapsed;
+
+  /* Never sent or not answered, the deadline reports it */
+  if (!p_evt_buf) return;
+
+  bt_codec::hci_event_view evt(bt_codec::view(
+      (uint8_t*)(p_evt_buf + 1) + p_evt_buf->offset, p_evt_buf->len));
+  status = evt.cmd_status(probe_opcode);
+
+  bt_vendor_free_evt(p_evt_buf);
+
+  /* Not the answer to the probe, keep waiting for it */
+  if (status == 0xff) return;
+
+  elapsed = bt_vendor_probe_finish();
+  if (elapsed < 0) {
+    ALOGE("Late controller probe response after deadline");
+    return;
+  }
+
+  probe_timing.total_ms += elapsed;
+
+  /* A controller that refuses a command it must support is not usable,
+   * it is answering though, so there is nothing to power cycle */
+  if (status) {
+    ALOGE("Controller probe 0x%04x failed in %lld ms, status 0x%02x",
+          probe_opcode, (long long)elapsed, status);
+
+    bt_stats_add("probe.error", 1);
+    bt_vendor_record_bringup(&probe_timing, 0);
+    bt_vendor_fw_cfg_done(BT_VND_OP_RESULT_FAIL);
+    return;
+  }
+
+  ALOGI("Controller probe 0x%04x answered in %lld ms", probe_opcode,
+        (long long)elapsed);
+
+  bt_stats_add("probe.ok", 1);
+  bt_stats_add("probe.latency_ms", elapsed);
+  bt_stats_max("probe.latency_max_ms", elapsed);
+
+  bt_vendor_record_bringup(&probe_timing, 1);
+  bt_vendor_fw_cfg_done(BT_VND_OP_RESULT_SUCCESS);
+}
+
+static void bt_vendor_probe_timeout(union sigval sv) {
+  (void)(sv);
+
+  if (bt_vendor_probe_finish() < 0) return;
+
+  ALOGE("Controller probe 0x%04x not answered within %d ms", probe_opcode,
+        probe_timeout);
+
+  bt_stats_add("probe.timeout", 1);
+  bt_vendor_recover("probe timeout");
+
+  probe_timing.total_ms += probe_timeout;
+  bt_vendor_record_bringup(&probe_timing, 0);
+
+  bt_vendor_fw_cfg_done(BT_VND_OP_RESULT_FAIL);
+}
+
+/*
+ * Sends a cheap command once the user channel is bound and reports the
+ * fw config result on the response, so that a wedged controller is caught
+ * within probe_timeout instead of the stack's own command timeout.
+ */
+static int bt_vendor_probe_start(void) {
+  struct itimerspec its;
+  struct sigevent se;
+
+  if (!probe_timer_created) {
+    memset(&se, 0, sizeof(se));
+    se.sigev_notify = SIGEV_THREAD;
+    se.sigev_notify_function = bt_vendor_probe_timeout;
+
+    if (timer_create(CLOCK_MONOTONIC, &se, &probe_timer)) {
+      ALOGE("Unable to create probe timer: %s", strerror(errno));
+      return -1;
+    }
+    probe_timer_created = 1;
+  }
+
+  pthread_mutex_lock(&probe_lock);
+
+  probe_pending = 1;
+  probe_start = bt_vendor_now_ms();
+
+  memset(&its, 0, sizeof(its));
+  its.it_value.tv_sec = probe_timeout / 1000;
+  its.it_value.tv_nsec = (probe_timeout % 1000) * 1000000;
+  timer_settime(probe_timer, 0, &its, NULL);
+
+  pthread_mutex_unlock(&probe_lock);
+
+  if (bt_vendor_send_cmd(probe_opcode, NULL, 0, bt_vendor_probe_cback)) {
+    bt_vendor_probe_finish();
+    return -1;
+  }
+
+  return 0;
+}
+
 /* TODO: fw config should thread the device waiting and return immediately */
 static void bt_vendor_fw_cfg(void) {
+  struct bt_vendor_timing timing;
   struct sockaddr_hci addr;
+  uint64_t start, ts;
   int fd = bt_vendor_fd;
+  int wait_budget;
 
   ALOGI("%s", __func__);
 
+  memset(&timing, 0, sizeof(timing));
+  ts = start = bt_vendor_now_ms();
+
+  wait_budget = bt_vendor_strategy->wait_ms;
+  if (!wait_budget)
+    wait_budget = bt_vendor_wait_budget("index", MGMT_EV_POLL_TIMEOUT);
+  mgmt_op_timeout = bt_vendor_wait_budget("mgmt", MGMT_OP_TIMEOUT);
+
+  ALOGI("%s bring-up, index budget %d ms, mgmt budget %d ms",
+        cold_boot ? "Cold" : "Warm", wait_budget, mgmt_op_timeout);
+
   if (fd == -1) {
     ALOGE("bt_vendor_fd: %s", strerror(EBADF));
     goto failure;
@@ -309,31 +1200,61 @@ static void bt_vendor_fw_cfg(void) {
   addr.hci_dev = hci_interface;
   addr.hci_channel = HCI_CHANNEL_USER;
 
-  if (bt_vendor_wait_hcidev()) {
-    ALOGE("HCI interface (%d) not found", hci_interface);
-    goto failure;
-  }
+  /* A speculative start skips the index wait when the device is already
+   * registered, the failed attempt is accounted to the wait phase */
+  if (!bt_vendor_strategy->speculative || bt_vendor_powerdown(fd)) {
+    if (bt_vendor_check_presence()) {
+      bt_stats_add("presence.absent", 1);
+      goto failure;
+    }
 
-  /* Force interface down to use HCI user channel */
-  if (ioctl(fd, IOCTL_HCIDEVDOWN, hci_interface)) {
-    ALOGE("HCIDEVDOWN ioctl error: %s", strerror(errno));
-    goto failure;
+    if (bt_vendor_wait_hcidev(wait_budget)) {
+      if (errno == ETIMEDOUT && !bt_vendor_strategy->wait_ms)
+        bt_vendor_wait_timeout("index", wait_budget, MGMT_EV_POLL_TIMEOUT);
+      ALOGE("HCI interface (%d) not found", hci_interface);
+      goto failure;
+    }
+
+    timing.wait_ms = bt_vendor_now_ms() - start;
+    bt_vendor_wait_sample("index", timing.wait_ms);
+    ts = bt_vendor_now_ms();
+
+    if (bt_vendor_powerdown(fd)) goto failure;
   }
 
+  timing.down_ms = bt_vendor_now_ms() - ts;
+  ts = bt_vendor_now_ms();
+
   if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
     ALOGE("socket bind error %s", strerror(errno));
     goto failure;
   }
 
+  timing.bind_ms = bt_vendor_now_ms() - ts;
+  timing.total_ms = bt_vendor_now_ms() - start;
+  /* Only a mgmt power off measures what bounds the mgmt operations */
+  if (bt_vendor_strategy->powerdown == BT_VENDOR_DOWN_MGMT)
+    bt_vendor_wait_sample("mgmt", timing.down_ms);
+
   ALOGI("HCI device ready");
 
-  bt_vendor_callbacks->fwcfg_cb(BT_VND_OP_RESULT_SUCCESS);
+  /* The probe reports the result, and records the bring-up, once the
+   * controller answers or the deadline passes */
+  if (probe_opcode) {
+    probe_timing = timing;
+    if (!bt_vendor_probe_start()) return;
+  }
+
+  bt_vendor_record_bringup(&timing, 1);
+  bt_vendor_fw_cfg_done(BT_VND_OP_RESULT_SUCCESS);
 
   return;
 
 failure:
   ALOGE("Hardware Config Error");
-  bt_vendor_callbacks->fwcfg_cb(BT_VND_OP_RESULT_FAIL);
+  timing.total_ms = bt_vendor_now_ms() - start;
+  bt_vendor_record_bringup(&timing, 0);
+  bt_vendor_fw_cfg_done(BT_VND_OP_RESULT_FAIL);
 }
 
 static int bt_vendor_op(bt_vendor_opcode_t opcode, void* param) {
@@ -383,18 +1304,31 @@ static int bt_vendor_op(bt_vendor_opcode_t opcode, void* param) {
     case BT_VND_OP_LPM_WAKE_SET_STATE:
       break;
 
-    case BT_VND_OP_SET_AUDIO_STATE:
+    case BT_VND_OP_SET_AUDIO_STATE: {
+      bt_vendor_op_audio_state_t* state = (bt_vendor_op_audio_state_t*)param;
+
+      /* A link in setup carries no audio yet, its session starts once
+       * the stack reports it on; off and off-transfer both end it */
+      if (state && state->state != AUDIO_STATE_SETUP) {
+        int active = state->state == AUDIO_STATE_ON;
+
+        bt_sco_set_audio(state->handle, active);
+        bt_coex_sco(state->handle, active);
+      }
       bt_vendor_callbacks->audio_state_cb(BT_VND_OP_RESULT_SUCCESS);
       break;
+    }
 
     case BT_VND_OP_EPILOG:
       bt_vendor_callbacks->epilog_cb(BT_VND_OP_RESULT_SUCCESS);
       break;
 
     case BT_VND_OP_A2DP_OFFLOAD_START:
+      bt_coex_a2dp(1);
       break;
 
     case BT_VND_OP_A2DP_OFFLOAD_STOP:
+      bt_coex_a2dp(0);
       break;
   }
 
@@ -406,6 +1340,17 @@ static int bt_vendor_op(bt_vendor_opcode_t opcode, void* param) {
 static void bt_vendor_cleanup(void) {
   ALOGI("%s", __func__);
 
+  bt_vendor_probe_finish();
+  if (probe_timer_created) {
+    timer_delete(probe_timer);
+    probe_timer_created = 0;
+  }
+
+  if (cmd_timer_created) {
+    timer_delete(cmd_timer);
+    cmd_timer_created = 0;
+  }
+
   bt_vendor_callbacks = NULL;
 }
 
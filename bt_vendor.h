@@ -0,0 +1,69 @@
+/**********************************************************************
+ *
+ *  Copyright (C) 2019-2020 Intel Corporation
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ *  implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ **********************************************************************/
+
+#ifndef BT_VENDOR_H
+#define BT_VENDOR_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include <sys/socket.h>
+
+#include "bt_vendor_lib.h"
+
+#define BTPROTO_HCI 1
+#define HCI_CHANNEL_USER 1
+#define HCI_CHANNEL_MONITOR 2
+#define HCI_CHANNEL_CONTROL 3
+#define HCI_DEV_NONE 0xffff
+
+#define HCI_READ_LOCAL_VERSION_INFO 0x1001
+
+struct sockaddr_hci {
+  sa_family_t hci_family;
+  unsigned short hci_dev;
+  unsigned short hci_channel;
+};
+
+static inline uint64_t bt_vendor_now_ms(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static inline uint64_t bt_vendor_now_us(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Sends an HCI command through the stack, cback may be NULL when the
+ * response is of no interest. Commands are sent one at a time; cback
+ * gets NULL if a queued command could not be sent after all */
+int bt_vendor_send_cmd(uint16_t opcode, const uint8_t* params, uint8_t plen,
+                       tINT_CMD_CBACK cback);
+/* Send time in ms of the library command in flight, 0 if none */
+uint64_t bt_vendor_cmd_sent(void);
+/* Releases the response buffer handed to a command callback */
+void bt_vendor_free_evt(void* p_mem);
+void bt_vendor_recover(const char* reason);
+
+#endif /* BT_VENDOR_H */
@@ -0,0 +1,254 @@
+/**********************************************************************
+ *
+ *  Copyright (C) 2019-2020 Intel Corporation
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ *  implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ **********************************************************************/
+
+
+#ifndef BT_VENDOR_CODEC_H
+#define BT_VENDOR_CODEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <array>
+
+/*
+ * Typed wire codec for the mgmt, monitor, HCI and Intel vendor packets
+ * the library builds and parses. Builders are constexpr and return a
+ * fixed-size byte array, views borrow a buffer and never read past its
+ * length: an out of range field reads as zero and valid() tells whether
+ * the packet is complete. Nothing here allocates.
+ */
+namespace bt_codec {
+
+constexpr size_t kMgmtHdrSize = 6;
+constexpr size_t kMonHdrSize = 6;
+constexpr size_t kHciCmdHdrSize = 3;
+constexpr size_t kHciEvtHdrSize = 2;
+constexpr size_t kHciAclHdrSize = 4;
+constexpr size_t kHciScoHdrSize = 3;
+constexpr size_t kRfkillEventSize = 8;
+
+constexpr uint8_t kHciEvCmdComplete = 0x0e;
+constexpr uint8_t kHciEvCmdStatus = 0x0f;
+constexpr uint8_t kRfkillOpChangeAll = 3;
+
+constexpr uint16_t get_le16(const uint8_t* p) {
+  return (uint16_t)(p[0] | p[1] << 8);
+}
+
+constexpr void put_le16(uint8_t* p, uint16_t v) {
+  p[0] = v & 0xff;
+  p[1] = v >> 8;
+}
+
+template <size_t N>
+using packet = std::array<uint8_t, N>;
+
+class view {
+ public:
+  constexpr view(const uint8_t* data, size_t len) : data_(data), len_(len) {}
+
+  constexpr const uint8_t* data() const { return data_; }
+  constexpr size_t size() const { return len_; }
+
+  constexpr bool has(size_t off, size_t n) const {
+    return off <= len_ && n <= len_ - off;
+  }
+
+  constexpr uint8_t u8(size_t off) const {
+    return has(off, 1) ? data_[off] : 0;
+  }
+
+  constexpr uint16_t le16(size_t off) const {
+    return has(off, 2) ? get_le16(data_ + off) : 0;
+  }
+
+  constexpr view sub(size_t off) const {
+    return has(off, 0) ? view(data_ + off, len_ - off) : view(data_, 0);
+  }
+
+ private:
+  const uint8_t* data_;
+  size_t len_;
+};
+
+/* mgmt command/event: opcode, index, parameter length, parameters */
+class mgmt_view : public view {
+ public:
+  constexpr mgmt_view(const uint8_t* data, size_t len) : view(data, len) {}
+
+  constexpr bool valid() const {
+    return has(0, kMgmtHdrSize) && has(kMgmtHdrSize, len());
+  }
+  constexpr uint16_t opcode() const { return le16(0); }
+  constexpr uint16_t index() const { return le16(2); }
+  constexpr uint16_t len() const { return le16(4); }
+  constexpr view params() const { return sub(kMgmtHdrSize); }
+};
+
+/* Command Complete / Command Status event parameters */
+class mgmt_cmd_status_view : public view {
+ public:
+  constexpr explicit mgmt_cmd_status_view(view v) : view(v) {}
+
+  constexpr bool valid() const { return has(0, 3); }
+  constexpr uint16_t opcode() const { return le16(0); }
+  constexpr uint8_t status() const { return u8(2); }
+  constexpr view rparams() const { return sub(3); }
+};
+
+/* Read Controller Index List return parameters */
+class mgmt_index_list_view : public view {
+ public:
+  constexpr explicit mgmt_index_list_view(view v) : view(v) {}
+
+  constexpr uint16_t num() const { return le16(0); }
+  constexpr bool has_index(size_t i) const { return has(2 + 2 * i, 2); }
+  constexpr uint16_t index(size_t i) const { return le16(2 + 2 * i); }
+};
+
+constexpr packet<kMgmtHdrSize> mgmt_cmd(uint16_t opcode, uint16_t index) {
+  packet<kMgmtHdrSize> p{};
+
+  put_le16(&p[0], opcode);
+  put_le16(&p[2], index);
+  put_le16(&p[4], 0);
+  return p;
+}
+
+constexpr packet<kMgmtHdrSize + 1> mgmt_cmd(uint16_t opcode, uint16_t index,
+                                            uint8_t param) {
+  packet<kMgmtHdrSize + 1> p{};
+
+  put_le16(&p[0], opcode);
+  put_le16(&p[2], index);
+  put_le16(&p[4], 1);
+  p[6] = param;
+  return p;
+}
+
+/* HCI_CHANNEL_MONITOR frame: opcode, index, length, HCI packet. The
+ * length is the one of the original packet, the payload may have been
+ * trimmed by a socket filter. */
+class mon_view : public view {
+ public:
+  constexpr mon_view(const uint8_t* data, size_t len) : view(data, len) {}
+
+  constexpr bool valid() const { return has(0, kMonHdrSize); }
+  constexpr uint16_t opcode() const { return le16(0); }
+  constexpr uint16_t index() const { return le16(2); }
+  constexpr uint16_t len() const { return le16(4); }
+  constexpr view payload() const { return sub(kMonHdrSize); }
+};
+
+class hci_event_view : public view {
+ public:
+  constexpr explicit hci_event_view(view v) : view(v) {}
+
+  constexpr bool valid() const { return has(0, kHciEvtHdrSize); }
+  constexpr uint8_t code() const { return u8(0); }
+  constexpr uint8_t plen() const { return u8(1); }
+  constexpr view params() const { return sub(kHciEvtHdrSize); }
+
+  /* Status answered to opcode by Command Complete or Command Status,
+   * 0xff for any other event */
+  constexpr uint8_t cmd_status(uint16_t opcode) const {
+    if (code() == kHciEvCmdComplete && has(0, 6) && le16(3) == opcode)
+      return u8(5);
+    if (code() == kHciEvCmdStatus && has(0, 6) && le16(4) == opcode)
+      return u8(2);
+    return 0xff;
+  }
+};
+
+/* Number Of Completed Packets parameters */
+class hci_nocp_view : public view {
+ public:
+  constexpr explicit hci_nocp_view(view v) : view(v) {}
+
+  constexpr uint8_t num() const { return u8(0); }
+  constexpr bool has_entry(size_t i) const { return has(1 + 4 * i, 4); }
+  constexpr uint16_t handle(size_t i) const {
+    return le16(1 + 4 * i) & 0x0fff;
+  }
+  constexpr uint16_t count(size_t i) const { return le16(3 + 4 * i); }
+};
+
+/* Disconnection Complete parameters */
+class hci_disconn_view : public view {
+ public:
+  constexpr explicit hci_disconn_view(view v) : view(v) {}
+
+  constexpr bool valid() const { return has(0, 4); }
+  constexpr uint8_t status() const { return u8(0); }
+  constexpr uint16_t handle() const { return le16(1) & 0x0fff; }
+  constexpr uint8_t reason() const { return u8(3); }
+};
+
+class hci_acl_view : public view {
+ public:
+  constexpr explicit hci_acl_view(view v) : view(v) {}
+
+  constexpr bool valid() const { return has(0, kHciAclHdrSize); }
+  constexpr uint16_t handle() const { return le16(0) & 0x0fff; }
+  constexpr uint8_t flags() const { return le16(0) >> 12; }
+  constexpr uint16_t dlen() const { return le16(2); }
+};
+
+class hci_sco_view : public view {
+ public:
+  constexpr explicit hci_sco_view(view v) : view(v) {}
+
+  constexpr bool valid() const { return has(0, kHciScoHdrSize); }
+  constexpr uint16_t handle() const { return le16(0) & 0x0fff; }
+  /* Packet_Status_Flag, only set with erroneous data reporting */
+  constexpr uint8_t status() const { return (le16(0) >> 12) & 0x03; }
+  constexpr uint8_t dlen() const { return u8(2); }
+};
+
+constexpr void put_hci_cmd_hdr(uint8_t* p, uint16_t opcode, uint8_t plen) {
+  put_le16(p, opcode);
+  p[2] = plen;
+}
+
+/* Intel vendor commands (OGF 0x3f) */
+constexpr uint16_t kIntelReadVersion = 0xfc05;
+
+/* struct rfkill_event: le32 idx, type, op, soft, hard */
+constexpr packet<kRfkillEventSize> rfkill_change_all(uint8_t type,
+                                                     uint8_t block) {
+  packet<kRfkillEventSize> p{};
+
+  p[4] = type;
+  p[5] = kRfkillOpChangeAll;
+  p[6] = block;
+  p[7] = block;
+  return p;
+}
+
+static_assert(mgmt_cmd(0x0003, 0xffff)[2] == 0xff, "mgmt index layout");
+static_assert(mgmt_view(mgmt_cmd(0x0005, 1, 0).data(), 7).valid(),
+              "mgmt length layout");
+constexpr uint8_t kSampleReset[] = {kHciEvCmdComplete, 4, 1, 0x03, 0x0c, 0};
+static_assert(hci_event_view(view(kSampleReset, 6)).cmd_status(0x0c03) == 0,
+              "HCI opcode is little endian");
+static_assert(rfkill_change_all(2, 1)[7] == 1, "rfkill hard block");
+
+}  // namespace bt_codec
+
+#endif /* BT_VENDOR_CODEC_H */
@@ -0,0 +1,241 @@
+/**********************************************************************
+ *
+ *  Copyright (C) 2019-2020 Intel Corporation
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ *  implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ **********************************************************************/
+
+
+#define LOG_TAG "bt_vendor"
+
+#include <ctype.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <utils/Log.h>
+#include <cutils/properties.h>
+
+#include "bt_vendor.h"
+#include "bt_vendor_codec.h"
+#include "bt_vendor_coex.h"
+#include "bt_vendor_stats.h"
+
+#define COEX_SCO_MAX 2
+#define COEX_PARAM_MAX 32
+
+/* Ordered by priority, the highest active profile is hinted */
+enum { COEX_NONE = -1, COEX_OFF, COEX_A2DP, COEX_SCO, COEX_PROFILES };
+
+static const char* const coex_name[COEX_PROFILES] = {"off", "a2dp", "sco"};
+
+struct bt_coex_hint {
+  uint8_t param[COEX_PARAM_MAX];
+  uint8_t len;
+};
+
+static uint16_t coex_opcode;
+static struct bt_coex_hint coex_hint[COEX_PROFILES];
+static pthread_mutex_t coex_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint16_t coex_sco[COEX_SCO_MAX];
+static int coex_sco_count;
+static int coex_a2dp_active;
+static int coex_current;
+static uint64_t coex_since;
+/* Hint sent and not answered yet, COEX_NONE if there is none */
+static int coex_sent = COEX_NONE;
+static uint64_t coex_sent_at;
+/* Hint the controller refused, not sent again until another succeeds */
+static int coex_rejected = COEX_NONE;
+
+/* "01 02 ff" or "0102ff" */
+static void bt_coex_parse(const char* str, struct bt_coex_hint* hint) {
+  char byte[3] = {};
+
+  hint->len = 0;
+  while (*str && hint->len < COEX_PARAM_MAX) {
+    if (isspace((unsigned char)*str)) {
+      str++;
+      continue;
+    }
+
+    if (!isxdigit((unsigned char)str[0]) || !isxdigit((unsigned char)str[1]))
+      break;
+
+    byte[0] = str[0];
+    byte[1] = str[1];
+    hint->param[hint->len++] = strtoul(byte, NULL, 16);
+    str += 2;
+  }
+}
+
+void bt_coex_init(void) {
+  char prop_value[PROPERTY_VALUE_MAX];
+  char key[PROPERTY_KEY_MAX];
+  int i;
+
+  /* The hint command and its parameters depend on the controller
+   * firmware, so both come from the board configuration */
+  property_get("vendor.bluetooth.coex_opcode", prop_value, "0");
+  coex_opcode = strtoul(prop_value, NULL, 16);
+  if (!coex_opcode) return;
+
+  for (i = 0; i < COEX_PROFILES; i++) {
+    snprintf(key, sizeof(key), "vendor.bluetooth.coex_%s", coex_name[i]);
+    property_get(key, prop_value, "");
+    bt_coex_parse(prop_value, &coex_hint[i]);
+  }
+
+  ALOGI("Coexistence hints enabled, opcode 0x%04x", coex_opcode);
+}
+
+/* Must be called with coex_lock held */
+static void bt_coex_close_session(uint64_t now) {
+  char key[BT_STATS_KEY_MAX];
+
+  if (coex_current == COEX_OFF) return;
+
+  snprintf(key, sizeof(key), "coex.%s.ms", coex_name[coex_current]);
+  bt_stats_add(key, now - coex_since);
+}
+
+static void bt_coex_cback(void* p_mem);
+
+/*
+ * Must be called with coex_lock held. The hinted profile only changes
+ * once the controller accepted the hint; a change made meanwhile is
+ * sent when the outstanding hint is answered.
+ */
+static void bt_coex_update(void) {
+  struct bt_coex_hint* hint;
+  int profile;
+
+  profile = coex_sco_count ? COEX_SCO
+                           : (coex_a2dp_active ? COEX_A2DP : COEX_OFF);
+  if (!coex_opcode || coex_sent != COEX_NONE || profile == coex_current ||
+      profile == coex_rejected)
+    return;
+
+  ALOGI("Coexistence hint %s -> %s", coex_name[coex_current],
+        coex_name[profile]);
+
+  hint = &coex_hint[profile];
+  if (bt_vendor_send_cmd(coex_opcode, hint->param, hint->len,
+                         bt_coex_cback)) {
+    bt_stats_add("coex.failed", 1);
+    return;
+  }
+
+  coex_sent = profile;
+  coex_sent_at = bt_vendor_now_us();
+  bt_stats_add("coex.cmds", 1);
+}
+
+static void bt_coex_cback(void* p_mem) {
+  HC_BT_HDR* p_evt_buf = (HC_BT_HDR*)p_mem;
+  uint64_t now = bt_vendor_now_us();
+  char key[BT_STATS_KEY_MAX];
+  uint8_t status = 0xff;
+  int profile;
+
+  if (p_evt_buf) {
+    bt_codec::hci_event_view evt(bt_codec::view(
+        (uint8_t*)(p_evt_buf + 1) + p_evt_buf->offset, p_evt_buf->len));
+
+    status = evt.cmd_status(coex_opcode);
+    bt_vendor_free_evt(p_evt_buf);
+  }
+
+  pthread_mutex_lock(&coex_lock);
+
+  /* Answer to a hint sent before a reset */
+  profile = coex_sent;
+  if (profile == COEX_NONE) goto out;
+
+  coex_sent = COEX_NONE;
+
+  if (p_evt_buf) {
+    bt_stats_add("coex.latency_us", now - coex_sent_at);
+    bt_stats_max("coex.latency_max_us", now - coex_sent_at);
+  }
+
+  if (status) {
+    ALOGE("Coexistence hint %s failed, status 0x%02x", coex_name[profile],
+          status);
+    bt_stats_add("coex.failed", 1);
+    coex_rejected = profile;
+    bt_coex_update();
+    goto out;
+  }
+
+  bt_coex_close_session(now / 1000);
+  coex_current = profile;
+  coex_since = now / 1000;
+  coex_rejected = COEX_NONE;
+
+  if (profile != COEX_OFF) {
+    snprintf(key, sizeof(key), "coex.%s.sessions", coex_name[profile]);
+    bt_stats_add(key, 1);
+  }
+
+  bt_coex_update();
+
+out:
+  pthread_mutex_unlock(&coex_lock);
+}
+
+void bt_coex_sco(uint16_t handle, int active) {
+  int i;
+
+  pthread_mutex_lock(&coex_lock);
+
+  for (i = 0; i < coex_sco_count && coex_sco[i] != handle; i++)
+    ;
+
+  if (active && i == coex_sco_count && coex_sco_count < COEX_SCO_MAX)
+    coex_sco[coex_sco_count++] = handle;
+  else if (!active && i < coex_sco_count)
+    coex_sco[i] = coex_sco[--coex_sco_count];
+
+  bt_coex_update();
+
+  pthread_mutex_unlock(&coex_lock);
+}
+
+void bt_coex_a2dp(int active) {
+  pthread_mutex_lock(&coex_lock);
+
+  coex_a2dp_active = active;
+  bt_coex_update();
+
+  pthread_mutex_unlock(&coex_lock);
+}
+
+/* The controller loses the hint when it is closed, only the session
+ * is accounted */
+void bt_coex_reset(void) {
+  pthread_mutex_lock(&coex_lock);
+
+  bt_coex_close_session(bt_vendor_now_ms());
+  coex_current = COEX_OFF;
+  coex_sco_count = 0;
+  coex_a2dp_active = 0;
+  coex_sent = COEX_NONE;
+  coex_rejected = COEX_NONE;
+
+  pthread_mutex_unlock(&coex_lock);
+}
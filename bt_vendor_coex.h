@@ -0,0 +1,36 @@
+/**********************************************************************
+ *
+ *  Copyright (C) 2019-2020 Intel Corporation
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ *  implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ **********************************************************************/
+
+
+#ifndef BT_VENDOR_COEX_H
+#define BT_VENDOR_COEX_H
+
+#include <stdint.h>
+
+/*
+ * Wi-Fi/Bluetooth coexistence hints. While SCO or A2DP offload audio is
+ * active the controller is told which profile to protect; the hint is
+ * cleared once no audio is left.
+ */
+void bt_coex_init(void);
+void bt_coex_sco(uint16_t handle, int active);
+void bt_coex_a2dp(int active);
+void bt_coex_reset(void);
+
+#endif /* BT_VENDOR_COEX_H */
@@ -0,0 +1,288 @@
+/**********************************************************************
+ *
+ *  Copyright (C) 2019-2020 Intel Corporation
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ *  implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ **********************************************************************/
+
+
+#define LOG_TAG "bt_vendor"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/uio.h>
+
+#include <utils/Log.h>
+#include <cutils/properties.h>
+
+#include "bt_vendor.h"
+#include "bt_vendor_dump.h"
+#include "bt_vendor_monitor.h"
+#include "bt_vendor_stats.h"
+
+#define DUMP_FILE BT_DUMP_DIR "/fw_dump.bin"
+#define DUMP_PREALLOC (1024 * 1024)
+#define DUMP_IDLE 500 /* 500ms without fragments ends a dump */
+#define DUMP_BATCH 16
+
+#define HCI_EV_VENDOR 0xff
+
+/* Intel debug and exception events start with this TLV header */
+static const uint8_t intel_diag_hdr[] = {0x87, 0x80, 0x03};
+
+static int dump_en;
+static int dump_running;
+static int dump_stopping;
+static pthread_t dump_thread;
+static pthread_mutex_t dump_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dump_cond;
+static struct bt_pkt* dump_queue[BT_PKT_POOL_SIZE];
+static int dump_head;
+static int dump_count;
+static uint64_t dump_last_frag;
+static uint64_t dump_lost;
+
+/* Writer thread only */
+static int dump_fd = -1;
+static uint64_t dump_bytes;
+static uint64_t dump_frags;
+static uint64_t dump_begin;
+
+void bt_dump_init(void) {
+  char prop_value[PROPERTY_VALUE_MAX];
+  pthread_condattr_t attr;
+
+  property_get("vendor.bluetooth.fw_dump", prop_value, "0");
+
+  dump_en = atoi(prop_value);
+  if (!dump_en) return;
+
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&dump_cond, &attr);
+  pthread_condattr_destroy(&attr);
+
+  ALOGI("Firmware dump capture enabled");
+}
+
+int bt_dump_enabled(void) { return dump_en; }
+
+static int bt_dump_is_fragment(bt_codec::mon_view mon) {
+  bt_codec::hci_event_view evt(mon.payload());
+
+  if (mon.opcode() == HCI_MON_VENDOR_DIAG) return 1;
+
+  if (mon.opcode() != HCI_MON_EVENT_PKT || evt.code() != HCI_EV_VENDOR)
+    return 0;
+
+  return evt.params().has(0, sizeof(intel_diag_hdr)) &&
+         !memcmp(evt.params().data(), intel_diag_hdr, sizeof(intel_diag_hdr));
+}
+
+void bt_dump_packet(struct bt_pkt* pkt, bt_codec::mon_view mon) {
+  if (!dump_running || !bt_dump_is_fragment(mon)) return;
+
+  pthread_mutex_lock(&dump_lock);
+
+  /* Every queued buffer holds a pool reference, so the queue cannot
+   * outgrow the pool */
+  dump_queue[(dump_head + dump_count) % BT_PKT_POOL_SIZE] = bt_pkt_get(pkt);
+  dump_count++;
+  dump_last_frag = bt_vendor_now_ms();
+
+  pthread_cond_signal(&dump_cond);
+  pthread_mutex_unlock(&dump_lock);
+}
+
+/* The monitor had to discard a frame because the pool ran dry, which
+ * a lagging writer causes by holding its queued buffers */
+void bt_dump_dropped(void) {
+  if (!dump_running) return;
+
+  pthread_mutex_lock(&dump_lock);
+
+  if (dump_count || bt_vendor_now_ms() < dump_last_frag + DUMP_IDLE) {
+    if (!dump_lost) ALOGE("Firmware dump losing frames, pool exhausted");
+    dump_lost++;
+  }
+
+  pthread_mutex_unlock(&dump_lock);
+}
+
+static void bt_dump_open(void) {
+  dump_bytes = 0;
+  dump_frags = 0;
+  dump_begin = bt_vendor_now_ms();
+
+  rename(DUMP_FILE, DUMP_FILE ".old");
+
+  dump_fd = open(DUMP_FILE, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (dump_fd < 0) {
+    ALOGE("Unable to create %s: %s", DUMP_FILE, strerror(errno));
+    return;
+  }
+
+  /* Reserve the blocks up front so that streaming never allocates */
+  if (fallocate(dump_fd, FALLOC_FL_KEEP_SIZE, 0, DUMP_PREALLOC) < 0)
+    ALOGE("Unable to preallocate %s: %s", DUMP_FILE, strerror(errno));
+
+  ALOGI("Firmware dump started");
+}
+
+static void bt_dump_close(void) {
+  uint64_t lost;
+
+  if (dump_fd < 0) return;
+
+  pthread_mutex_lock(&dump_lock);
+  lost = dump_lost;
+  dump_lost = 0;
+  pthread_mutex_unlock(&dump_lock);
+
+  /* Give back the preallocated blocks past the end of the dump */
+  if (ftruncate(dump_fd, dump_bytes) < 0 || fdatasync(dump_fd) < 0)
+    ALOGE("Unable to finish %s: %s", DUMP_FILE, strerror(errno));
+
+  close(dump_fd);
+  dump_fd = -1;
+
+  ALOGI("Firmware dump done: %llu fragments, %llu bytes in %llu ms",
+        (unsigned long long)dump_frags, (unsigned long long)dump_bytes,
+        (unsigned long long)(bt_vendor_now_ms() - dump_begin));
+
+  if (lost) {
+    ALOGE("Firmware dump incomplete, %llu frames lost",
+          (unsigned long long)lost);
+    bt_stats_add("dump.incomplete", 1);
+    bt_stats_add("dump.lost", lost);
+  }
+
+  bt_stats_add("dump.count", 1);
+  bt_stats_add("dump.bytes", dump_bytes);
+  bt_stats_save();
+}
+
+static void bt_dump_write(struct bt_pkt** pkts, int count) {
+  struct iovec iov[DUMP_BATCH];
+  ssize_t n;
+  int i;
+
+  if (dump_fd < 0) bt_dump_open();
+
+  for (i = 0; i < count; i++) {
+    iov[i].iov_base = pkts[i]->data;
+    iov[i].iov_len = pkts[i]->len;
+  }
+
+  if (dump_fd >= 0) {
+    n = writev(dump_fd, iov, count);
+    if (n < 0)
+      ALOGE("Unable to write %s: %s", DUMP_FILE, strerror(errno));
+    else
+      dump_bytes += n;
+  }
+
+  dump_frags += count;
+
+  for (i = 0; i < count; i++) bt_pkt_put(pkts[i]);
+}
+
+static void* bt_dump_run(void* arg) {
+  struct bt_pkt* pkts[DUMP_BATCH];
+  struct timespec ts;
+  uint64_t deadline;
+  int count;
+
+  (void)(arg);
+
+  pthread_mutex_lock(&dump_lock);
+
+  while (1) {
+    while (!dump_count && !dump_stopping) {
+      if (dump_fd < 0) {
+        pthread_cond_wait(&dump_cond, &dump_lock);
+        continue;
+      }
+
+      deadline = dump_last_frag + DUMP_IDLE;
+      if (bt_vendor_now_ms() >= deadline) {
+        pthread_mutex_unlock(&dump_lock);
+        bt_dump_close();
+        pthread_mutex_lock(&dump_lock);
+        continue;
+      }
+
+      ts.tv_sec = deadline / 1000;
+      ts.tv_nsec = (deadline % 1000) * 1000000;
+      pthread_cond_timedwait(&dump_cond, &dump_lock, &ts);
+    }
+
+    if (!dump_count) break;
+
+    for (count = 0; count < DUMP_BATCH && dump_count; count++) {
+      pkts[count] = dump_queue[dump_head];
+      dump_head = (dump_head + 1) % BT_PKT_POOL_SIZE;
+      dump_count--;
+    }
+
+    pthread_mutex_unlock(&dump_lock);
+    bt_dump_write(pkts, count);
+    pthread_mutex_lock(&dump_lock);
+  }
+
+  pthread_mutex_unlock(&dump_lock);
+
+  bt_dump_close();
+
+  return NULL;
+}
+
+int bt_dump_start(void) {
+  if (!dump_en || dump_running) return 0;
+
+  dump_stopping = 0;
+  dump_head = 0;
+  dump_count = 0;
+  dump_lost = 0;
+
+  if (pthread_create(&dump_thread, NULL, bt_dump_run, NULL)) {
+    ALOGE("Unable to start dump thread");
+    return -1;
+  }
+
+  dump_running = 1;
+
+  return 0;
+}
+
+/* Drains the queue and finishes a dump in progress */
+void bt_dump_stop(void) {
+  if (!dump_running) return;
+
+  pthread_mutex_lock(&dump_lock);
+  dump_stopping = 1;
+  pthread_cond_signal(&dump_cond);
+  pthread_mutex_unlock(&dump_lock);
+
+  pthread_join(dump_thread, NULL);
+  dump_running = 0;
+}
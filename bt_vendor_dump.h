@@ -0,0 +1,42 @@
+/**********************************************************************
+ *
+ *  Copyright (C) 2019-2020 Intel Corporation
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ *  implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ **********************************************************************/
+
+
+#ifndef BT_VENDOR_DUMP_H
+#define BT_VENDOR_DUMP_H
+
+#include "bt_vendor_codec.h"
+#include "bt_vendor_pool.h"
+
+#define BT_DUMP_DIR "/data/vendor/bluetooth"
+
+/*
+ * Firmware debug dump capture. The monitor thread hands dump fragments
+ * over by reference and a writer thread streams them to
+ * BT_DUMP_DIR/fw_dump.bin as raw monitor frames, so neither the monitor
+ * nor a recovery waits for the disk.
+ */
+void bt_dump_init(void);
+int bt_dump_enabled(void);
+int bt_dump_start(void);
+void bt_dump_stop(void);
+void bt_dump_packet(struct bt_pkt* pkt, bt_codec::mon_view mon);
+void bt_dump_dropped(void);
+
+#endif /* BT_VENDOR_DUMP_H */
@@ -0,0 +1,203 @@
+/**********************************************************************
+ *
+ *  Copyright (C) 2019-2020 Intel Corporation
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ *  implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ **********************************************************************/
+
+
+#define LOG_TAG "bt_vendor"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <utils/Log.h>
+#include <cutils/properties.h>
+
+#include "bt_vendor_latency.h"
+#include "bt_vendor_stats.h"
+
+#define HCI_EV_DISCONN_COMPLETE 0x05
+#define HCI_EV_NUM_COMP_PKTS 0x13
+
+#define LATENCY_MAX_LINKS 8
+#define LATENCY_FIFO_SIZE 64
+#define LATENCY_BUCKETS 12 /* < 0.5 ms, < 1 ms, < 2 ms ... < 512 ms, more */
+
+struct bt_latency_link {
+  int used;
+  uint16_t handle;
+  uint16_t head;
+  uint16_t count;
+  uint64_t fifo[LATENCY_FIFO_SIZE];
+  uint32_t hist[LATENCY_BUCKETS];
+  uint64_t pkts;
+  uint64_t sum_us;
+  uint64_t max_us;
+  uint64_t desync;
+};
+
+static int latency_en;
+static struct bt_latency_link links[LATENCY_MAX_LINKS];
+
+void bt_latency_init(void) {
+  char prop_value[PROPERTY_VALUE_MAX];
+
+  property_get("vendor.bluetooth.acl_latency", prop_value, "0");
+
+  latency_en = atoi(prop_value);
+  if (latency_en) ALOGI("ACL transit latency tracing enabled");
+}
+
+int bt_latency_enabled(void) { return latency_en; }
+
+void bt_latency_reset(void) { memset(links, 0, sizeof(links)); }
+
+static struct bt_latency_link* bt_latency_link(uint16_t handle, int create) {
+  int i;
+
+  for (i = 0; i < LATENCY_MAX_LINKS; i++)
+    if (links[i].used && links[i].handle == handle) return &links[i];
+
+  if (!create) return NULL;
+
+  for (i = 0; i < LATENCY_MAX_LINKS; i++) {
+    if (!links[i].used) {
+      memset(&links[i], 0, sizeof(links[i]));
+      links[i].used = 1;
+      links[i].handle = handle;
+      return &links[i];
+    }
+  }
+
+  return NULL;
+}
+
+static int bt_latency_bucket(uint64_t us) {
+  uint64_t bound = 500;
+  int i;
+
+  for (i = 0; i < LATENCY_BUCKETS - 1; i++, bound <<= 1)
+    if (us < bound) return i;
+
+  return LATENCY_BUCKETS - 1;
+}
+
+static void bt_latency_report(struct bt_latency_link* link) {
+  char key[BT_STATS_KEY_MAX];
+  char hist[LATENCY_BUCKETS * 11 + 1];
+  int i, len = 0;
+
+  if (!link->pkts) return;
+
+  for (i = 0; i < LATENCY_BUCKETS; i++) {
+    len += snprintf(hist + len, sizeof(hist) - len, " %u", link->hist[i]);
+
+    snprintf(key, sizeof(key), "acl.transit.bucket%d", i);
+    bt_stats_add(key, link->hist[i]);
+  }
+
+  bt_stats_add("acl.transit.pkts", link->pkts);
+  bt_stats_add("acl.transit.sum_us", link->sum_us);
+  bt_stats_max("acl.transit.max_us", link->max_us);
+  bt_stats_add("acl.transit.desync", link->desync);
+
+  ALOGI("ACL handle 0x%03x transit: %llu pkts, avg %llu us, max %llu us, "
+        "desync %llu, histogram%s", link->handle,
+        (unsigned long long)link->pkts,
+        (unsigned long long)(link->sum_us / link->pkts),
+        (unsigned long long)link->max_us, (unsigned long long)link->desync,
+        hist);
+}
+
+void bt_latency_acl_tx(bt_codec::hci_acl_view acl, uint64_t now_us) {
+  struct bt_latency_link* link;
+
+  if (!latency_en || !acl.valid()) return;
+
+  link = bt_latency_link(acl.handle(), 1);
+  if (!link) return;
+
+  /* More in flight than the controller can buffer, the FIFO no longer
+   * lines up with the completions */
+  if (link->count == LATENCY_FIFO_SIZE) {
+    link->desync++;
+    link->count = 0;
+  }
+
+  link->fifo[(link->head + link->count) % LATENCY_FIFO_SIZE] = now_us;
+  link->count++;
+}
+
+static void bt_latency_complete(uint16_t handle, uint16_t num,
+                                uint64_t now_us) {
+  struct bt_latency_link* link;
+  uint64_t us;
+
+  link = bt_latency_link(handle, 0);
+  if (!link) return;
+
+  while (num-- && link->count) {
+    us = now_us > link->fifo[link->head] ? now_us - link->fifo[link->head] : 0;
+    link->head = (link->head + 1) % LATENCY_FIFO_SIZE;
+    link->count--;
+
+    link->hist[bt_latency_bucket(us)]++;
+    link->pkts++;
+    link->sum_us += us;
+    if (us > link->max_us) link->max_us = us;
+  }
+}
+
+void bt_latency_event(bt_codec::hci_event_view evt, uint64_t now_us) {
+  struct bt_latency_link* link;
+  size_t i;
+
+  if (!latency_en || !evt.valid()) return;
+
+  switch (evt.code()) {
+    case HCI_EV_NUM_COMP_PKTS: {
+      bt_codec::hci_nocp_view nocp(evt.params());
+
+      for (i = 0; i < nocp.num() && nocp.has_entry(i); i++)
+        bt_latency_complete(nocp.handle(i), nocp.count(i), now_us);
+      break;
+    }
+
+    case HCI_EV_DISCONN_COMPLETE: {
+      bt_codec::hci_disconn_view disconn(evt.params());
+
+      if (!disconn.valid() || disconn.status() != 0) break;
+
+      link = bt_latency_link(disconn.handle(), 0);
+      if (!link) break;
+
+      bt_latency_report(link);
+      link->used = 0;
+      break;
+    }
+  }
+}
+
+void bt_latency_flush(void) {
+  int i;
+
+  for (i = 0; i < LATENCY_MAX_LINKS; i++)
+    if (links[i].used) bt_latency_report(&links[i]);
+
+  bt_latency_reset();
+}
@@ -0,0 +1,40 @@
+/**********************************************************************
+ *
+ *  Copyright (C) 2019-2020 Intel Corporation
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ *  implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ **********************************************************************/
+
+
+#ifndef BT_VENDOR_LATENCY_H
+#define BT_VENDOR_LATENCY_H
+
+#include <stdint.h>
+
+#include "bt_vendor_codec.h"
+
+/*
+ * Controller-side ACL transit latency: outbound ACL packets are
+ * timestamped per connection handle and matched in order against
+ * Number_Of_Completed_Packets. Called from the monitor thread only.
+ */
+void bt_latency_init(void);
+int bt_latency_enabled(void);
+void bt_latency_reset(void);
+void bt_latency_acl_tx(bt_codec::hci_acl_view acl, uint64_t now_us);
+void bt_latency_event(bt_codec::hci_event_view evt, uint64_t now_us);
+void bt_latency_flush(void);
+
+#endif /* BT_VENDOR_LATENCY_H */
@@ -0,0 +1,576 @@
+/**********************************************************************
+ *
+ *  Copyright (C) 2019-2020 Intel Corporation
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ *  implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ **********************************************************************/
+
+
+#define LOG_TAG "bt_vendor"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+
+#include <linux/filter.h>
+
+#include <utils/Log.h>
+#include <cutils/properties.h>
+
+#include "bt_vendor.h"
+#include "bt_vendor_codec.h"
+#include "bt_vendor_dump.h"
+#include "bt_vendor_latency.h"
+#include "bt_vendor_monitor.h"
+#include "bt_vendor_pool.h"
+#include "bt_vendor_sco.h"
+#include "bt_vendor_stats.h"
+
+#define WATCHDOG_TIMEOUT 500 /* 500ms */
+
+#define COST_BUCKETS 16 /* < 1 us, < 2 us ... < 16 ms, more */
+
+#define FILTER_MAX_DROP 8
+#define FILTER_ISO_HDR_SIZE 4
+
+static int monitor_fd = -1;
+static int monitor_pipe[2] = {-1, -1};
+static int monitor_index;
+static int monitor_running;
+static pthread_t monitor_thread;
+static uint64_t monitor_pkts;
+static uint64_t monitor_bytes;
+static uint64_t monitor_dropped;
+static uint64_t monitor_traffic;
+static uint64_t monitor_cpu_us;
+static uint32_t monitor_cost[COST_BUCKETS];
+/* Pool exhaustion already folded into the stats, the pool counts for
+ * the whole process */
+static uint64_t monitor_pool_exhausted;
+
+static int filter_headers;
+static int filter_drop_count;
+static uint16_t filter_drop[FILTER_MAX_DROP];
+
+static int watchdog_interval;
+static int watchdog_timeout;
+static int watchdog_hung;
+static uint64_t watchdog_last_rx;
+static uint64_t watchdog_probe_sent;
+
+void bt_monitor_init(void) {
+  char prop_value[PROPERTY_VALUE_MAX];
+
+  property_get("vendor.bluetooth.watchdog", prop_value, "0");
+  watchdog_interval = atoi(prop_value);
+  if (watchdog_interval < 0) watchdog_interval = 0;
+
+  property_get("vendor.bluetooth.watchdog_timeout", prop_value, "500");
+  watchdog_timeout = atoi(prop_value);
+  if (watchdog_timeout <= 0) watchdog_timeout = WATCHDOG_TIMEOUT;
+
+  if (watchdog_interval)
+    ALOGI("Liveness watchdog enabled, idle %d ms, timeout %d ms",
+          watchdog_interval, watchdog_timeout);
+
+  bt_latency_init();
+  bt_dump_init();
+  bt_sco_init();
+
+  /* "headers" (default) truncates ACL, SCO and ISO payloads in the kernel,
+   * "full" keeps them. Commands and events are always kept in full. */
+  property_get("vendor.bluetooth.monitor_filter", prop_value, "headers");
+  filter_headers = strcmp(prop_value, "full") != 0;
+
+  /* Comma separated hex connection handles whose data is never captured */
+  property_get("vendor.bluetooth.monitor_drop", prop_value, "");
+
+  char* saveptr = NULL;
+  char* tok;
+
+  filter_drop_count = 0;
+  for (tok = strtok_r(prop_value, ",", &saveptr);
+       tok && filter_drop_count < FILTER_MAX_DROP;
+       tok = strtok_r(NULL, ",", &saveptr))
+    filter_drop[filter_drop_count++] = strtol(tok, NULL, 16) & 0x0fff;
+}
+
+static int bt_monitor_enabled(void) {
+  return watchdog_interval > 0 || bt_latency_enabled() || bt_dump_enabled() ||
+         bt_sco_enabled();
+}
+
+static void bt_watchdog_rx(uint64_t now) {
+  if (watchdog_probe_sent) {
+    bt_stats_add("watchdog.probe_latency_ms", now - watchdog_probe_sent);
+    bt_stats_max("watchdog.probe_latency_max_ms", now - watchdog_probe_sent);
+  }
+
+  if (watchdog_hung) ALOGI("Controller responding again");
+
+  watchdog_last_rx = now;
+  watchdog_probe_sent = 0;
+  watchdog_hung = 0;
+}
+
+static int bt_watchdog_poll_timeout(uint64_t now) {
+  uint64_t deadline;
+
+  if (!watchdog_interval || watchdog_hung) return -1;
+
+  if (watchdog_probe_sent)
+    deadline = watchdog_probe_sent + watchdog_timeout;
+  else
+    deadline = watchdog_last_rx + watchdog_interval;
+
+  return deadline > now ? (int)(deadline - now) : 0;
+}
+
+/*
+ * Nothing received for watchdog_interval: send a harmless command and
+ * expect any controller traffic within watchdog_timeout. A controller
+ * that stays silent is power cycled once; the watchdog then waits for
+ * traffic before it probes again.
+ */
+static void bt_watchdog_tick(uint64_t now) {
+  uint64_t sent;
+
+  if (!watchdog_interval || watchdog_hung) return;
+
+  if (!watchdog_probe_sent) {
+    if (now - watchdog_last_rx < (uint64_t)watchdog_interval) return;
+
+    /* A library command already awaits its response, it serves as the
+     * probe and a hang shows as it going unanswered */
+    sent = bt_vendor_cmd_sent();
+    if (sent) {
+      watchdog_probe_sent = sent < now ? sent : now;
+      return;
+    }
+
+    if (bt_vendor_send_cmd(HCI_READ_LOCAL_VERSION_INFO, NULL, 0, NULL)) {
+      watchdog_last_rx = now;
+      return;
+    }
+
+    watchdog_probe_sent = now;
+    bt_stats_add("watchdog.probes", 1);
+    return;
+  }
+
+  if (now - watchdog_probe_sent < (uint64_t)watchdog_timeout) return;
+
+  ALOGE("Controller not responding, silent for %llu ms",
+        (unsigned long long)(now - watchdog_last_rx));
+
+  watchdog_hung = 1;
+  watchdog_probe_sent = 0;
+
+  bt_stats_add("watchdog.hangs", 1);
+  bt_vendor_recover("liveness watchdog");
+  bt_stats_save();
+}
+
+/* Monotonic time at which the kernel queued the frame, the kernel stamp
+ * is on the realtime clock */
+static uint64_t bt_monitor_pkt_time(struct msghdr* msg, uint64_t now_us) {
+  struct cmsghdr* cmsg;
+  struct timespec real, ts;
+  int64_t age;
+
+  for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_TIMESTAMPNS)
+      continue;
+
+    memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+    clock_gettime(CLOCK_REALTIME, &real);
+
+    age = (int64_t)(real.tv_sec - ts.tv_sec) * 1000000 +
+          (real.tv_nsec - ts.tv_nsec) / 1000;
+    if (age > 0 && (uint64_t)age < now_us) return now_us - age;
+    break;
+  }
+
+  return now_us;
+}
+
+static void bt_monitor_dispatch(struct bt_pkt* pkt, uint64_t now_us,
+                                uint64_t pkt_us) {
+  bt_codec::mon_view mon(pkt->data, pkt->len);
+
+  if (!mon.valid() || mon.index() != monitor_index) return;
+
+  monitor_pkts++;
+  monitor_bytes += pkt->len;
+  monitor_traffic += bt_codec::kMonHdrSize + mon.len();
+
+  switch (mon.opcode()) {
+    case HCI_MON_EVENT_PKT:
+      bt_watchdog_rx(now_us / 1000);
+      bt_latency_event(bt_codec::hci_event_view(mon.payload()), pkt_us);
+      bt_dump_packet(pkt, mon);
+      break;
+
+    case HCI_MON_VENDOR_DIAG:
+      /* Diagnostic data is controller traffic too, a dump in progress
+       * must not look like a hung controller */
+      bt_watchdog_rx(now_us / 1000);
+      bt_dump_packet(pkt, mon);
+      break;
+
+    case HCI_MON_ACL_TX_PKT:
+      bt_latency_acl_tx(bt_codec::hci_acl_view(mon.payload()), pkt_us);
+      break;
+
+    case HCI_MON_SCO_TX_PKT:
+      bt_sco_packet(bt_codec::hci_sco_view(mon.payload()), 0, pkt_us);
+      break;
+
+    case HCI_MON_SCO_RX_PKT:
+      bt_sco_packet(bt_codec::hci_sco_view(mon.payload()), 1, pkt_us);
+      bt_watchdog_rx(now_us / 1000);
+      break;
+
+    case HCI_MON_ACL_RX_PKT:
+    case HCI_MON_ISO_RX_PKT:
+      bt_watchdog_rx(now_us / 1000);
+      break;
+  }
+}
+
+static int bt_monitor_cost_bucket(uint64_t us) {
+  int i;
+
+  for (i = 0; i < COST_BUCKETS - 1; i++)
+    if (us < (1ull << i)) return i;
+
+  return COST_BUCKETS - 1;
+}
+
+/* Upper bound in us of the bucket holding the given per mille */
+static uint64_t bt_monitor_cost_percentile(int per_mille) {
+  uint64_t total = 0, seen = 0;
+  int i;
+
+  for (i = 0; i < COST_BUCKETS; i++) total += monitor_cost[i];
+
+  for (i = 0; i < COST_BUCKETS; i++) {
+    seen += monitor_cost[i];
+    if (seen * 1000 >= total * per_mille) break;
+  }
+
+  return 1ull << (i < COST_BUCKETS - 1 ? i : COST_BUCKETS - 1);
+}
+
+static void* bt_monitor_run(void* arg) {
+  char control[CMSG_SPACE(sizeof(struct timespec))];
+  struct pollfd fds[2];
+  struct timespec ts;
+  struct bt_pkt* pkt;
+  struct msghdr msg;
+  struct iovec iov;
+  uint64_t start;
+  ssize_t n;
+
+  (void)(arg);
+
+  fds[0].fd = monitor_fd;
+  fds[0].events = POLLIN;
+  fds[1].fd = monitor_pipe[0];
+  fds[1].events = POLLIN;
+
+  watchdog_last_rx = bt_vendor_now_ms();
+
+  while (1) {
+    n = poll(fds, 2, bt_watchdog_poll_timeout(bt_vendor_now_ms()));
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      ALOGE("Monitor poll error: %s", strerror(errno));
+      break;
+    }
+
+    if (fds[1].revents) break;
+
+    if (fds[0].revents & POLLIN) {
+      pkt = bt_pkt_alloc();
+      if (!pkt) {
+        /* Discard the datagram, the pool is busy */
+        recv(monitor_fd, NULL, 0, 0);
+        monitor_dropped++;
+        bt_dump_dropped();
+      } else {
+        iov.iov_base = pkt->data;
+        iov.iov_len = BT_PKT_DATA_MAX;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        start = bt_vendor_now_us();
+        n = recvmsg(monitor_fd, &msg, 0);
+        if (n < 0 && errno != EINTR) {
+          ALOGE("Monitor read error: %s", strerror(errno));
+          bt_pkt_put(pkt);
+          break;
+        }
+
+        if (n > 0) {
+          pkt->len = n;
+          bt_monitor_dispatch(pkt, start, bt_monitor_pkt_time(&msg, start));
+        }
+        bt_pkt_put(pkt);
+
+        monitor_cost[bt_monitor_cost_bucket(bt_vendor_now_us() - start)]++;
+      }
+    } else if (fds[0].revents & (POLLERR | POLLHUP)) {
+      ALOGE("Monitor socket closed");
+      break;
+    }
+
+    bt_watchdog_tick(bt_vendor_now_ms());
+  }
+
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  monitor_cpu_us = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+
+  return NULL;
+}
+
+#define FILTER_NEXT -1
+
+struct bt_filter {
+  struct sock_filter code[34 + 3 * FILTER_MAX_DROP];
+  int n;
+};
+
+static void bt_filter_stmt(struct bt_filter* f, uint16_t code, uint32_t k) {
+  f->code[f->n].code = code;
+  f->code[f->n].jt = 0;
+  f->code[f->n].jf = 0;
+  f->code[f->n].k = k;
+  f->n++;
+}
+
+/* jt and jf are absolute instruction indexes or FILTER_NEXT */
+static void bt_filter_jeq(struct bt_filter* f, uint32_t k, int jt, int jf) {
+  f->code[f->n].code = BPF_JMP | BPF_JEQ | BPF_K;
+  f->code[f->n].jt = jt == FILTER_NEXT ? 0 : jt - f->n - 1;
+  f->code[f->n].jf = jf == FILTER_NEXT ? 0 : jf - f->n - 1;
+  f->code[f->n].k = k;
+  f->n++;
+}
+
+/*
+ * Classic BPF run by the kernel on every monitor frame, which starts
+ * with the little endian header read by bt_codec::mon_view. Frames of
+ * other controllers and of the dropped handles are rejected, and data
+ * payloads are cut down to their HCI headers in "headers" mode, before
+ * anything is copied to user space.
+ */
+static int bt_monitor_attach_filter(int fd, int index) {
+  static const uint32_t hdr_size[] = {bt_codec::kHciAclHdrSize,
+                                      bt_codec::kHciScoHdrSize,
+                                      FILTER_ISO_HDR_SIZE};
+  struct bt_filter f;
+  struct sock_fprog prog;
+  int acl, sco, iso, drop;
+  int i, blk;
+
+  /* 4 index checks and 8 opcode checks, then the ACL, SCO and ISO
+   * blocks of handle decode, drop checks and return, then the drop */
+  acl = 12;
+  sco = acl + 7 + filter_drop_count;
+  iso = sco + 7 + filter_drop_count;
+  drop = iso + 7 + filter_drop_count;
+
+  f.n = 0;
+
+  bt_filter_stmt(&f, BPF_LD | BPF_B | BPF_ABS, 2);
+  bt_filter_jeq(&f, index & 0xff, FILTER_NEXT, drop);
+  bt_filter_stmt(&f, BPF_LD | BPF_B | BPF_ABS, 3);
+  bt_filter_jeq(&f, (index >> 8) & 0xff, FILTER_NEXT, drop);
+
+  bt_filter_stmt(&f, BPF_LD | BPF_B | BPF_ABS, 0);
+  bt_filter_jeq(&f, HCI_MON_ACL_TX_PKT, acl, FILTER_NEXT);
+  bt_filter_jeq(&f, HCI_MON_ACL_RX_PKT, acl, FILTER_NEXT);
+  bt_filter_jeq(&f, HCI_MON_SCO_TX_PKT, sco, FILTER_NEXT);
+  bt_filter_jeq(&f, HCI_MON_SCO_RX_PKT, sco, FILTER_NEXT);
+  bt_filter_jeq(&f, HCI_MON_ISO_TX_PKT, iso, FILTER_NEXT);
+  bt_filter_jeq(&f, HCI_MON_ISO_RX_PKT, iso, FILTER_NEXT);
+  bt_filter_stmt(&f, BPF_RET | BPF_K, 0xffffffff);
+
+  for (blk = 0; blk < 3; blk++) {
+    /* A = connection handle, low 12 bits of the first data le16 */
+    bt_filter_stmt(&f, BPF_LD | BPF_B | BPF_ABS, bt_codec::kMonHdrSize + 1);
+    bt_filter_stmt(&f, BPF_ALU | BPF_AND | BPF_K, 0x0f);
+    bt_filter_stmt(&f, BPF_ALU | BPF_LSH | BPF_K, 8);
+    bt_filter_stmt(&f, BPF_MISC | BPF_TAX, 0);
+    bt_filter_stmt(&f, BPF_LD | BPF_B | BPF_ABS, bt_codec::kMonHdrSize);
+    bt_filter_stmt(&f, BPF_ALU | BPF_OR | BPF_X, 0);
+
+    for (i = 0; i < filter_drop_count; i++)
+      bt_filter_jeq(&f, filter_drop[i], drop, FILTER_NEXT);
+
+    bt_filter_stmt(&f, BPF_RET | BPF_K,
+                   filter_headers ? bt_codec::kMonHdrSize + hdr_size[blk]
+                                  : 0xffffffff);
+  }
+
+  bt_filter_stmt(&f, BPF_RET | BPF_K, 0);
+
+  prog.len = f.n;
+  prog.filter = f.code;
+
+  if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0) {
+    ALOGE("Monitor filter error: %s", strerror(errno));
+    return -1;
+  }
+
+  ALOGI("Monitor filter attached, %s, %d handles dropped",
+        filter_headers ? "headers only" : "full payload", filter_drop_count);
+
+  return 0;
+}
+
+int bt_monitor_start(int index) {
+  struct sockaddr_hci addr;
+  int on = 1;
+
+  if (!bt_monitor_enabled() || monitor_running) return 0;
+
+  monitor_fd = socket(AF_BLUETOOTH, SOCK_RAW, BTPROTO_HCI);
+  if (monitor_fd < 0) {
+    ALOGE("Monitor socket error: %s", strerror(errno));
+    return -1;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.hci_family = AF_BLUETOOTH;
+  addr.hci_dev = HCI_DEV_NONE;
+  addr.hci_channel = HCI_CHANNEL_MONITOR;
+
+  if (bind(monitor_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    ALOGE("HCI Channel Monitor: %s", strerror(errno));
+    goto failure;
+  }
+
+  /* Without the filter the monitor still works, only less efficiently */
+  bt_monitor_attach_filter(monitor_fd, index);
+
+  /* Packet timing is taken from the kernel, not from when the thread
+   * got to read the frame */
+  if (setsockopt(monitor_fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) < 0)
+    ALOGE("Monitor timestamps: %s", strerror(errno));
+
+  if (pipe(monitor_pipe) < 0) {
+    ALOGE("Monitor pipe error: %s", strerror(errno));
+    goto failure;
+  }
+
+  monitor_index = index;
+  monitor_pkts = 0;
+  monitor_bytes = 0;
+  monitor_dropped = 0;
+  monitor_traffic = 0;
+  monitor_cpu_us = 0;
+  memset(monitor_cost, 0, sizeof(monitor_cost));
+  watchdog_hung = 0;
+  watchdog_probe_sent = 0;
+  bt_latency_reset();
+
+  if (bt_dump_start()) goto failure;
+
+  if (pthread_create(&monitor_thread, NULL, bt_monitor_run, NULL)) {
+    ALOGE("Unable to start monitor thread");
+    bt_dump_stop();
+    goto failure;
+  }
+
+  monitor_running = 1;
+
+  ALOGI("Monitoring hci%d", index);
+
+  return 0;
+
+failure:
+  if (monitor_pipe[0] != -1) {
+    close(monitor_pipe[0]);
+    close(monitor_pipe[1]);
+    monitor_pipe[0] = monitor_pipe[1] = -1;
+  }
+  close(monitor_fd);
+  monitor_fd = -1;
+  return -1;
+}
+
+void bt_monitor_stop(void) {
+  struct bt_pkt_pool_stats pool_stats;
+  char c = 0;
+
+  if (!monitor_running) return;
+
+  if (write(monitor_pipe[1], &c, 1) != 1)
+    ALOGE("Monitor stop error: %s", strerror(errno));
+
+  pthread_join(monitor_thread, NULL);
+  monitor_running = 0;
+
+  bt_dump_stop();
+
+  close(monitor_pipe[0]);
+  close(monitor_pipe[1]);
+  monitor_pipe[0] = monitor_pipe[1] = -1;
+  close(monitor_fd);
+  monitor_fd = -1;
+
+  ALOGI("monitor: %llu packets, %llu of %llu bytes captured, %llu dropped",
+        (unsigned long long)monitor_pkts, (unsigned long long)monitor_bytes,
+        (unsigned long long)monitor_traffic,
+        (unsigned long long)monitor_dropped);
+
+  /* The stack's data path does not go through the library, the cost of
+   * watching it is the monitor thread's CPU time and per packet work */
+  if (monitor_traffic)
+    ALOGI("monitor cost: %llu us cpu, %llu us per MB, per packet p50 < %llu "
+          "us, p99 < %llu us", (unsigned long long)monitor_cpu_us,
+          (unsigned long long)(monitor_cpu_us * 1048576 / monitor_traffic),
+          (unsigned long long)bt_monitor_cost_percentile(500),
+          (unsigned long long)bt_monitor_cost_percentile(990));
+
+  bt_stats_add("monitor.pkts", monitor_pkts);
+  bt_stats_add("monitor.captured_bytes", monitor_bytes);
+  bt_stats_add("monitor.traffic_bytes", monitor_traffic);
+  bt_stats_add("monitor.dropped", monitor_dropped);
+  bt_stats_add("monitor.cpu_us", monitor_cpu_us);
+
+  bt_pkt_pool_get_stats(&pool_stats);
+  bt_stats_add("pool.exhausted",
+                pool_stats.exhausted - monitor_pool_exhausted);
+  bt_stats_max("pool.high_water", pool_stats.high_water);
+  monitor_pool_exhausted = pool_stats.exhausted;
+
+  bt_latency_flush();
+  bt_sco_flush();
+  bt_stats_save();
+}
@@ -0,0 +1,48 @@
+/**********************************************************************
+ *
+ *  Copyright (C) 2019-2020 Intel Corporation
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ *  implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ **********************************************************************/
+
+
+#ifndef BT_VENDOR_MONITOR_H
+#define BT_VENDOR_MONITOR_H
+
+#include <stdint.h>
+
+#define HCI_MON_NEW_INDEX 0
+#define HCI_MON_DEL_INDEX 1
+#define HCI_MON_COMMAND_PKT 2
+#define HCI_MON_EVENT_PKT 3
+#define HCI_MON_ACL_TX_PKT 4
+#define HCI_MON_ACL_RX_PKT 5
+#define HCI_MON_SCO_TX_PKT 6
+#define HCI_MON_SCO_RX_PKT 7
+#define HCI_MON_VENDOR_DIAG 11
+#define HCI_MON_ISO_TX_PKT 18
+#define HCI_MON_ISO_RX_PKT 19
+
+/*
+ * Passive view of the HCI traffic of the bound interface through
+ * HCI_CHANNEL_MONITOR. The stack keeps talking to the user channel fd
+ * directly; the monitor only runs when a feature that needs it is
+ * enabled.
+ */
+void bt_monitor_init(void);
+int bt_monitor_start(int index);
+void bt_monitor_stop(void);
+
+#endif /* BT_VENDOR_MONITOR_H */
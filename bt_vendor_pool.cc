@@ -0,0 +1,128 @@
+/**********************************************************************
+ *
+ *  Copyright (C) 2019-2020 Intel Corporation
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ *  implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ **********************************************************************/
+
+#define LOG_TAG "bt_vendor"
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <utils/Log.h>
+
+#include "bt_vendor_pool.h"
+
+#define BT_PKT_NONE 0xffffffffu
+
+/* Free list head: generation tag in the upper 32 bits, buffer index in
+ * the lower 32 bits. The tag is bumped on every update so that a stale
+ * head cannot be swapped back in (ABA). */
+static std::atomic<uint64_t> pool_head;
+static std::atomic<uint32_t> pool_in_use;
+static std::atomic<uint32_t> pool_high_water;
+static std::atomic<uint64_t> pool_allocs;
+static std::atomic<uint64_t> pool_exhausted;
+static struct bt_pkt pool[BT_PKT_POOL_SIZE];
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+static void bt_pkt_pool_setup(void) {
+  uint32_t i;
+
+  for (i = 0; i < BT_PKT_POOL_SIZE; i++) {
+    pool[i].refcnt.store(0, std::memory_order_relaxed);
+    pool[i].next.store(i + 1 < BT_PKT_POOL_SIZE ? i + 1 : BT_PKT_NONE,
+                       std::memory_order_relaxed);
+  }
+
+  pool_head.store(0, std::memory_order_release);
+}
+
+void bt_pkt_pool_init(void) { pthread_once(&pool_once, bt_pkt_pool_setup); }
+
+static void bt_pkt_free(struct bt_pkt* pkt) {
+  uint32_t idx = (uint32_t)(pkt - pool);
+  uint64_t head = pool_head.load(std::memory_order_relaxed);
+  uint64_t next;
+
+  do {
+    pkt->next.store((uint32_t)head, std::memory_order_relaxed);
+    next = ((head >> 32) + 1) << 32 | idx;
+  } while (!pool_head.compare_exchange_weak(head, next,
+                                            std::memory_order_release,
+                                            std::memory_order_relaxed));
+
+  pool_in_use.fetch_sub(1, std::memory_order_relaxed);
+}
+
+struct bt_pkt* bt_pkt_alloc(void) {
+  uint64_t head = pool_head.load(std::memory_order_acquire);
+  uint64_t next;
+  uint32_t idx, used, hw;
+
+  do {
+    idx = (uint32_t)head;
+    if (idx == BT_PKT_NONE) {
+      pool_exhausted.fetch_add(1, std::memory_order_relaxed);
+      return NULL;
+    }
+    next = ((head >> 32) + 1) << 32 |
+           pool[idx].next.load(std::memory_order_relaxed);
+  } while (!pool_head.compare_exchange_weak(head, next,
+                                            std::memory_order_acquire,
+                                            std::memory_order_acquire));
+
+  pool_allocs.fetch_add(1, std::memory_order_relaxed);
+  used = pool_in_use.fetch_add(1, std::memory_order_relaxed) + 1;
+  hw = pool_high_water.load(std::memory_order_relaxed);
+  while (used > hw &&
+         !pool_high_water.compare_exchange_weak(hw, used,
+                                                std::memory_order_relaxed))
+    ;
+
+  pool[idx].refcnt.store(1, std::memory_order_relaxed);
+  pool[idx].len = 0;
+
+  return &pool[idx];
+}
+
+struct bt_pkt* bt_pkt_get(struct bt_pkt* pkt) {
+  pkt->refcnt.fetch_add(1, std::memory_order_relaxed);
+  return pkt;
+}
+
+void bt_pkt_put(struct bt_pkt* pkt) {
+  if (pkt->refcnt.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    bt_pkt_free(pkt);
+}
+
+void bt_pkt_pool_get_stats(struct bt_pkt_pool_stats* stats) {
+  stats->size = BT_PKT_POOL_SIZE;
+  stats->in_use = pool_in_use.load(std::memory_order_relaxed);
+  stats->high_water = pool_high_water.load(std::memory_order_relaxed);
+  stats->allocs = pool_allocs.load(std::memory_order_relaxed);
+  stats->exhausted = pool_exhausted.load(std::memory_order_relaxed);
+}
+
+void bt_pkt_pool_dump(void) {
+  struct bt_pkt_pool_stats stats;
+
+  bt_pkt_pool_get_stats(&stats);
+
+  ALOGI("packet pool: %u/%u in use, high water %u, allocs %llu, exhausted %llu",
+        stats.in_use, stats.size, stats.high_water,
+        (unsigned long long)stats.allocs, (unsigned long long)stats.exhausted);
+}
@@ -0,0 +1,58 @@
+/**********************************************************************
+ *
+ *  Copyright (C) 2019-2020 Intel Corporation
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ *  implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ **********************************************************************/
+
+#ifndef BT_VENDOR_POOL_H
+#define BT_VENDOR_POOL_H
+
+#include <stdint.h>
+
+#include <atomic>
+
+/* Monitor header (6) + ACL header (4) + largest ACL payload the kernel
+ * accepts (HCI_MAX_ACL_SIZE, 1024). Events and SCO frames are smaller. */
+#define BT_PKT_DATA_MAX (6 + 4 + 1024)
+#define BT_PKT_POOL_SIZE 64
+
+/* Preallocated HCI packet buffer. A buffer is handed out with a
+ * reference count of one; every additional consumer takes its own
+ * reference with bt_pkt_get() and drops it with bt_pkt_put(). The
+ * buffer returns to the pool when the last reference is dropped. */
+struct bt_pkt {
+  std::atomic<uint32_t> refcnt;
+  std::atomic<uint32_t> next;
+  uint16_t len;
+  uint8_t data[BT_PKT_DATA_MAX];
+};
+
+struct bt_pkt_pool_stats {
+  uint32_t size;
+  uint32_t in_use;
+  uint32_t high_water;
+  uint64_t allocs;
+  uint64_t exhausted;
+};
+
+void bt_pkt_pool_init(void);
+struct bt_pkt* bt_pkt_alloc(void);
+struct bt_pkt* bt_pkt_get(struct bt_pkt* pkt);
+void bt_pkt_put(struct bt_pkt* pkt);
+void bt_pkt_pool_get_stats(struct bt_pkt_pool_stats* stats);
+void bt_pkt_pool_dump(void);
+
+#endif /* BT_VENDOR_POOL_H */
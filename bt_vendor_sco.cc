@@ -0,0 +1,264 @@
+/**********************************************************************
+ *
+ *  Copyright (C) 2019-2020 Intel Corporation
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ *  implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ **********************************************************************/
+
+
+#define LOG_TAG "bt_vendor"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <utils/Log.h>
+#include <cutils/properties.h>
+
+#include "bt_vendor.h"
+#include "bt_vendor_sco.h"
+#include "bt_vendor_stats.h"
+
+#define SCO_MAX_SESSIONS 2
+#define SCO_BUCKETS 12     /* < 0.25 ms, < 0.5 ms ... < 2.75 ms, more */
+#define SCO_BUCKET_US 250
+#define SCO_GAP 20         /* 20ms */
+
+/* Packet_Status_Flag values with erroneous data reporting */
+enum {
+  SCO_STATUS_OK,
+  SCO_STATUS_INVALID,
+  SCO_STATUS_LOST,
+  SCO_STATUS_PARTIAL,
+  SCO_STATUS_MAX
+};
+
+/*
+ * The link interval (3.75 ms, 7.5 ms ...) is not known here, it is
+ * learnt as the running mean of the intervals. Jitter is the deviation
+ * of each interval from it, kept as a histogram and as the RFC 3550
+ * running estimate J += (|D| - J) / 16. Gaps are loss, not jitter, and
+ * stay out of both.
+ */
+struct bt_sco_dir {
+  uint64_t last_us;
+  uint64_t pkts;
+  uint64_t gaps;
+  uint64_t max_gap_us;
+  int64_t interval_us; /* running mean, 0 until the first interval */
+  uint64_t jitter;     /* in 1/16 us */
+  uint64_t max_jitter;
+  uint32_t hist[SCO_BUCKETS];
+};
+
+struct bt_sco_session {
+  int active;
+  uint16_t handle;
+  uint64_t start_us;
+  struct bt_sco_dir dir[2]; /* tx, rx */
+  uint64_t status[SCO_STATUS_MAX];
+};
+
+static int sco_en;
+static uint64_t sco_gap_us;
+static struct bt_sco_session sessions[SCO_MAX_SESSIONS];
+static pthread_mutex_t sco_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void bt_sco_init(void) {
+  char prop_value[PROPERTY_VALUE_MAX];
+  int gap;
+
+  property_get("vendor.bluetooth.sco_stats", prop_value, "0");
+  sco_en = atoi(prop_value);
+
+  property_get("vendor.bluetooth.sco_gap", prop_value, "20");
+  gap = atoi(prop_value);
+  sco_gap_us = (gap > 0 ? gap : SCO_GAP) * 1000ull;
+
+  if (sco_en)
+    ALOGI("SCO statistics enabled, gap %llu ms",
+          (unsigned long long)(sco_gap_us / 1000));
+}
+
+int bt_sco_enabled(void) { return sco_en; }
+
+static int bt_sco_bucket(uint64_t us) {
+  uint64_t i = us / SCO_BUCKET_US;
+
+  return i < SCO_BUCKETS - 1 ? (int)i : SCO_BUCKETS - 1;
+}
+
+static void bt_sco_interval(struct bt_sco_dir* d, uint64_t us) {
+  int64_t dev;
+  uint64_t abs_dev;
+
+  if (us >= sco_gap_us) {
+    d->gaps++;
+    if (us > d->max_gap_us) d->max_gap_us = us;
+    return;
+  }
+
+  if (!d->interval_us) {
+    d->interval_us = us;
+    return;
+  }
+
+  dev = (int64_t)us - d->interval_us;
+  abs_dev = dev < 0 ? -dev : dev;
+
+  d->interval_us += dev / 16;
+  d->jitter += abs_dev - ((d->jitter + 8) >> 4);
+  if (d->jitter > d->max_jitter) d->max_jitter = d->jitter;
+
+  d->hist[bt_sco_bucket(abs_dev)]++;
+}
+
+/* Must be called with sco_lock held */
+static struct bt_sco_session* bt_sco_session(uint16_t handle) {
+  int i;
+
+  for (i = 0; i < SCO_MAX_SESSIONS; i++)
+    if (sessions[i].active && sessions[i].handle == handle)
+      return &sessions[i];
+
+  return NULL;
+}
+
+/* Must be called with sco_lock held */
+static void bt_sco_report(struct bt_sco_session* ss, uint64_t now_us) {
+  static const char* const dir_name[] = {"tx", "rx"};
+  char hist[SCO_BUCKETS * 11 + 1];
+  char key[BT_STATS_KEY_MAX];
+  struct bt_sco_dir* d;
+  int i, j, len;
+
+  bt_stats_add("sco.sessions", 1);
+  bt_stats_add("sco.invalid", ss->status[SCO_STATUS_INVALID]);
+  bt_stats_add("sco.lost", ss->status[SCO_STATUS_LOST]);
+  bt_stats_add("sco.partial", ss->status[SCO_STATUS_PARTIAL]);
+
+  for (i = 0; i < 2; i++) {
+    d = &ss->dir[i];
+
+    len = 0;
+    for (j = 0; j < SCO_BUCKETS; j++) {
+      len += snprintf(hist + len, sizeof(hist) - len, " %u", d->hist[j]);
+
+      snprintf(key, sizeof(key), "sco.%s.jitter%d", dir_name[i], j);
+      bt_stats_add(key, d->hist[j]);
+    }
+
+    snprintf(key, sizeof(key), "sco.%s.jitter_max_us", dir_name[i]);
+    bt_stats_max(key, d->max_jitter >> 4);
+    snprintf(key, sizeof(key), "sco.%s.pkts", dir_name[i]);
+    bt_stats_add(key, d->pkts);
+    snprintf(key, sizeof(key), "sco.%s.gaps", dir_name[i]);
+    bt_stats_add(key, d->gaps);
+
+    ALOGI("SCO handle 0x%03x %s: %llu pkts, interval %lld us, jitter %llu "
+          "us (max %llu), %llu gaps (max %llu us), deviation histogram%s",
+          ss->handle, dir_name[i], (unsigned long long)d->pkts,
+          (long long)d->interval_us, (unsigned long long)(d->jitter >> 4),
+          (unsigned long long)(d->max_jitter >> 4),
+          (unsigned long long)d->gaps, (unsigned long long)d->max_gap_us,
+          hist);
+  }
+
+  ALOGI("SCO handle 0x%03x: %llu ms, %llu invalid, %llu lost, %llu partial",
+        ss->handle, (unsigned long long)((now_us - ss->start_us) / 1000),
+        (unsigned long long)ss->status[SCO_STATUS_INVALID],
+        (unsigned long long)ss->status[SCO_STATUS_LOST],
+        (unsigned long long)ss->status[SCO_STATUS_PARTIAL]);
+
+  ss->active = 0;
+}
+
+void bt_sco_set_audio(uint16_t handle, int active) {
+  struct bt_sco_session* ss;
+  int i;
+
+  if (!sco_en) return;
+
+  pthread_mutex_lock(&sco_lock);
+
+  ss = bt_sco_session(handle);
+
+  if (!active) {
+    if (ss) bt_sco_report(ss, bt_vendor_now_us());
+  } else if (!ss) {
+    for (i = 0; i < SCO_MAX_SESSIONS && sessions[i].active; i++)
+      ;
+
+    if (i < SCO_MAX_SESSIONS) {
+      ss = &sessions[i];
+      memset(ss, 0, sizeof(*ss));
+      ss->active = 1;
+      ss->handle = handle;
+      ss->start_us = bt_vendor_now_us();
+    }
+  }
+
+  pthread_mutex_unlock(&sco_lock);
+}
+
+void bt_sco_packet(bt_codec::hci_sco_view sco, int rx, uint64_t now_us) {
+  struct bt_sco_session* ss;
+  struct bt_sco_dir* d;
+  uint64_t us;
+  uint8_t status;
+
+  if (!sco_en || !sco.valid()) return;
+
+  pthread_mutex_lock(&sco_lock);
+
+  ss = bt_sco_session(sco.handle());
+  if (!ss) goto end;
+
+  d = &ss->dir[rx ? 1 : 0];
+
+  if (d->pkts) {
+    us = now_us > d->last_us ? now_us - d->last_us : 0;
+    bt_sco_interval(d, us);
+  }
+
+  d->last_us = now_us;
+  d->pkts++;
+
+  status = sco.status();
+  if (rx && status != SCO_STATUS_OK) {
+    if (!ss->status[SCO_STATUS_INVALID] && !ss->status[SCO_STATUS_LOST] &&
+        !ss->status[SCO_STATUS_PARTIAL])
+      ALOGW("SCO handle 0x%03x erroneous data reported, status %u",
+            ss->handle, status);
+    ss->status[status]++;
+  }
+
+end:
+  pthread_mutex_unlock(&sco_lock);
+}
+
+void bt_sco_flush(void) {
+  uint64_t now_us = bt_vendor_now_us();
+  int i;
+
+  pthread_mutex_lock(&sco_lock);
+
+  for (i = 0; i < SCO_MAX_SESSIONS; i++)
+    if (sessions[i].active) bt_sco_report(&sessions[i], now_us);
+
+  pthread_mutex_unlock(&sco_lock);
+}
@@ -0,0 +1,38 @@
+/**********************************************************************
+ *
+ *  Copyright (C) 2019-2020 Intel Corporation
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ *  implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ **********************************************************************/
+
+
+#ifndef BT_VENDOR_SCO_H
+#define BT_VENDOR_SCO_H
+
+#include <stdint.h>
+
+#include "bt_vendor_codec.h"
+
+/*
+ * SCO/eSCO timing and loss statistics, collected per handle from the
+ * monitor while the stack reports the audio of that handle as active.
+ */
+void bt_sco_init(void);
+int bt_sco_enabled(void);
+void bt_sco_set_audio(uint16_t handle, int active);
+void bt_sco_packet(bt_codec::hci_sco_view sco, int rx, uint64_t now_us);
+void bt_sco_flush(void);
+
+#endif /* BT_VENDOR_SCO_H */
@@ -0,0 +1,283 @@
+/**********************************************************************
+ *
+ *  Copyright (C) 2019-2020 Intel Corporation
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ *  implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ **********************************************************************/
+
+#define LOG_TAG "bt_vendor"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <utils/Log.h>
+
+#include "bt_vendor_stats.h"
+
+#define BT_STATS_MAX 256
+#define BT_STATS_SERIES_MAX 8
+#define BT_STATS_LINE_MAX (BT_STATS_KEY_MAX + BT_STATS_SAMPLES * 11 + 2)
+
+struct bt_stats_entry {
+  char key[BT_STATS_KEY_MAX];
+  uint64_t val;
+};
+
+struct bt_stats_series {
+  char key[BT_STATS_KEY_MAX];
+  int head;
+  int count;
+  uint32_t val[BT_STATS_SAMPLES];
+};
+
+static struct bt_stats_entry stats[BT_STATS_MAX];
+static int stats_count;
+static struct bt_stats_series series[BT_STATS_SERIES_MAX];
+static int series_count;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Serializes writers of the stats file, taken before stats_lock */
+static pthread_mutex_t save_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Must be called with stats_lock held */
+static struct bt_stats_entry* bt_stats_find(const char* key, int create) {
+  int i;
+
+  for (i = 0; i < stats_count; i++)
+    if (!strncmp(stats[i].key, key, BT_STATS_KEY_MAX - 1)) return &stats[i];
+
+  if (!create) return NULL;
+
+  if (stats_count == BT_STATS_MAX) {
+    ALOGE("%s no room for %s", __func__, key);
+    return NULL;
+  }
+
+  snprintf(stats[stats_count].key, BT_STATS_KEY_MAX, "%s", key);
+  stats[stats_count].val = 0;
+
+  return &stats[stats_count++];
+}
+
+/* Must be called with stats_lock held */
+static struct bt_stats_series* bt_stats_find_series(const char* key,
+                                                    int create) {
+  int i;
+
+  for (i = 0; i < series_count; i++)
+    if (!strncmp(series[i].key, key, BT_STATS_KEY_MAX - 1)) return &series[i];
+
+  if (!create) return NULL;
+
+  if (series_count == BT_STATS_SERIES_MAX) {
+    ALOGE("%s no room for %s", __func__, key);
+    return NULL;
+  }
+
+  memset(&series[series_count], 0, sizeof(series[series_count]));
+  snprintf(series[series_count].key, BT_STATS_KEY_MAX, "%s", key);
+
+  return &series[series_count++];
+}
+
+/* Must be called with stats_lock held */
+static void bt_stats_push(struct bt_stats_series* ss, uint32_t val) {
+  ss->val[(ss->head + ss->count) % BT_STATS_SAMPLES] = val;
+
+  if (ss->count < BT_STATS_SAMPLES)
+    ss->count++;
+  else
+    ss->head = (ss->head + 1) % BT_STATS_SAMPLES;
+}
+
+/* "@<key> <oldest> ... <newest>" */
+static void bt_stats_load_series(char* line) {
+  struct bt_stats_series* ss;
+  char* saveptr = NULL;
+  char* tok;
+
+  tok = strtok_r(line + 1, " \n", &saveptr);
+  if (!tok) return;
+
+  ss = bt_stats_find_series(tok, 1);
+  if (!ss) return;
+
+  while ((tok = strtok_r(NULL, " \n", &saveptr)))
+    bt_stats_push(ss, strtoul(tok, NULL, 10));
+}
+
+void bt_stats_load(void) {
+  char line[BT_STATS_LINE_MAX];
+  char key[BT_STATS_KEY_MAX];
+  unsigned long long val;
+  struct bt_stats_entry* e;
+  FILE* f;
+
+  f = fopen(BT_STATS_FILE, "r");
+  if (!f) {
+    if (errno != ENOENT)
+      ALOGE("Unable to read %s: %s", BT_STATS_FILE, strerror(errno));
+    return;
+  }
+
+  pthread_mutex_lock(&stats_lock);
+
+  stats_count = 0;
+  series_count = 0;
+  while (fgets(line, sizeof(line), f)) {
+    if (line[0] == '@') {
+      bt_stats_load_series(line);
+      continue;
+    }
+
+    if (sscanf(line, "%47s %llu", key, &val) != 2) continue;
+
+    e = bt_stats_find(key, 1);
+    if (e) e->val = val;
+  }
+
+  pthread_mutex_unlock(&stats_lock);
+
+  fclose(f);
+}
+
+void bt_stats_save(void) {
+  struct bt_stats_series* ss;
+  FILE* f;
+  int i, j;
+
+  pthread_mutex_lock(&save_lock);
+
+  f = fopen(BT_STATS_FILE ".tmp", "w");
+  if (!f) {
+    ALOGE("Unable to write %s: %s", BT_STATS_FILE, strerror(errno));
+    goto out;
+  }
+
+  pthread_mutex_lock(&stats_lock);
+
+  for (i = 0; i < stats_count; i++)
+    fprintf(f, "%s %llu\n", stats[i].key, (unsigned long long)stats[i].val);
+
+  for (i = 0; i < series_count; i++) {
+    ss = &series[i];
+
+    fprintf(f, "@%s", ss->key);
+    for (j = 0; j < ss->count; j++)
+      fprintf(f, " %u", ss->val[(ss->head + j) % BT_STATS_SAMPLES]);
+    fprintf(f, "\n");
+  }
+
+  pthread_mutex_unlock(&stats_lock);
+
+  /* Make the new contents durable before they replace the old file */
+  if (fflush(f) || fsync(fileno(f))) {
+    ALOGE("Unable to write %s: %s", BT_STATS_FILE, strerror(errno));
+    fclose(f);
+    goto out;
+  }
+
+  if (fclose(f) || rename(BT_STATS_FILE ".tmp", BT_STATS_FILE))
+    ALOGE("Unable to write %s: %s", BT_STATS_FILE, strerror(errno));
+
+out:
+  pthread_mutex_unlock(&save_lock);
+}
+
+void bt_stats_add(const char* key, uint64_t val) {
+  struct bt_stats_entry* e;
+
+  pthread_mutex_lock(&stats_lock);
+
+  e = bt_stats_find(key, 1);
+  if (e) e->val += val;
+
+  pthread_mutex_unlock(&stats_lock);
+}
+
+void bt_stats_max(const char* key, uint64_t val) {
+  struct bt_stats_entry* e;
+
+  pthread_mutex_lock(&stats_lock);
+
+  e = bt_stats_find(key, 1);
+  if (e && val > e->val) e->val = val;
+
+  pthread_mutex_unlock(&stats_lock);
+}
+
+uint64_t bt_stats_get(const char* key) {
+  struct bt_stats_entry* e;
+  uint64_t val;
+
+  pthread_mutex_lock(&stats_lock);
+
+  e = bt_stats_find(key, 0);
+  val = e ? e->val : 0;
+
+  pthread_mutex_unlock(&stats_lock);
+
+  return val;
+}
+
+void bt_stats_set(const char* key, uint64_t val) {
+  struct bt_stats_entry* e;
+
+  pthread_mutex_lock(&stats_lock);
+
+  e = bt_stats_find(key, 1);
+  if (e) e->val = val;
+
+  pthread_mutex_unlock(&stats_lock);
+}
+
+void bt_stats_sample(const char* key, uint32_t val) {
+  struct bt_stats_series* ss;
+
+  pthread_mutex_lock(&stats_lock);
+
+  ss = bt_stats_find_series(key, 1);
+  if (ss) bt_stats_push(ss, val);
+
+  pthread_mutex_unlock(&stats_lock);
+}
+
+int bt_stats_get_samples(const char* key, uint32_t* val) {
+  struct bt_stats_series* ss;
+  int i, count = 0;
+
+  pthread_mutex_lock(&stats_lock);
+
+  ss = bt_stats_find_series(key, 0);
+  if (ss) {
+    for (i = 0; i < ss->count; i++)
+      val[i] = ss->val[(ss->head + i) % BT_STATS_SAMPLES];
+    count = ss->count;
+  }
+
+  pthread_mutex_unlock(&stats_lock);
+
+  return count;
+}
+
+void bt_stats_clear_samples(void) {
+  pthread_mutex_lock(&stats_lock);
+  series_count = 0;
+  pthread_mutex_unlock(&stats_lock);
+}
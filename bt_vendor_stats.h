@@ -0,0 +1,47 @@
+/**********************************************************************
+ *
+ *  Copyright (C) 2019-2020 Intel Corporation
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ *  implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ **********************************************************************/
+
+#ifndef BT_VENDOR_STATS_H
+#define BT_VENDOR_STATS_H
+
+#include <stdint.h>
+
+#define BT_STATS_FILE "/data/vendor/bluetooth/bt_vendor_stats"
+#define BT_STATS_KEY_MAX 48
+#define BT_STATS_SAMPLES 64
+
+/* Named counters persisted across boots in BT_STATS_FILE, one
+ * "<key> <value>" pair per line. Keys longer than BT_STATS_KEY_MAX - 1
+ * are truncated. */
+void bt_stats_load(void);
+void bt_stats_save(void);
+void bt_stats_add(const char* key, uint64_t val);
+void bt_stats_max(const char* key, uint64_t val);
+void bt_stats_set(const char* key, uint64_t val);
+uint64_t bt_stats_get(const char* key);
+
+/* Rolling series of the last BT_STATS_SAMPLES values, persisted as one
+ * "@<key> <oldest> ... <newest>" line. bt_stats_get_samples() copies
+ * the series oldest first into val, which must hold BT_STATS_SAMPLES
+ * values, and returns the number of samples. */
+void bt_stats_sample(const char* key, uint32_t val);
+int bt_stats_get_samples(const char* key, uint32_t* val);
+void bt_stats_clear_samples(void);
+
+#endif /* BT_VENDOR_STATS_H */